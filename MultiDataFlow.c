@@ -11,12 +11,36 @@
 #include <linux/fs.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
-#include <linux/interrupt.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
 #include <linux/moduleparam.h>
 #include <linux/wait.h>
 #include <linux/pid.h>
 #include <linux/tty.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+#include <linux/jiffies.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/rcupdate.h>
+#include <linux/cpumask.h>
+#include <linux/nospec.h>
+
+#include "MultiDataFlow.h"
+
+#define CREATE_TRACE_POINTS
+#include "MultiDataFlow_trace.h"
 
 
 
@@ -25,40 +49,183 @@ MODULE_AUTHOR("Alessio Malavasi");
 
 #define MODNAME "MULTI FLOW"
 
+/*
+   Counters of the operations on the two flows of a dev, every cpu increments its own copy.
+   All the fields are u64 arrays, so the copies are summed as a plain array of u64.
+*/
+typedef struct _flow_stats{
+   u64 bytes_written[2];
+   u64 writes[2];
+   u64 short_writes[2]; // writes truncated to the free space
+   u64 bytes_read[2];
+   u64 reads[2];
+   u64 short_reads[2]; // reads truncated to the valid bytes
+   u64 sleeps[2]; // sleeps in the read, write and deferred queues
+   u64 timeouts[2]; // sleeps ended by the timeout
+   u64 wakeups[2]; // sleeps ended by a wake up
+   u64 dropped_readers[2]; // broadcast subscribers dropped for lagging behind the writers
+   u64 overwritten[2]; // bytes, or messages in record mode, evicted by the writers in overwrite mode
+} flow_stats;
+
+/*
+   Latency histograms of a dev, bucket i counts the waits of [2^i, 2^(i+1)) ns,
+   the last bucket also the longer ones
+*/
+#define LATENCY_BUCKETS 40
+
+typedef struct _flow_latency{
+   atomic_long_t rd_wait[2][LATENCY_BUCKETS]; // time of a read in the read queue of the two flows
+   atomic_long_t wt_wait[2][LATENCY_BUCKETS]; // time of a write in the write queue of the two flows
+   atomic_long_t deferred[LATENCY_BUCKETS]; // time from put_work to the append of a low priority write
+} flow_latency;
+
+/*
+   Sub-buffer of the high priority flow for the writers running on one cpu, in sharded mode.
+   Every write is stored with a header of SHARD_HEADER bytes: its length and the monotonic time
+   it was made, read on the cpu of the shard, so the reader takes the writes of all the shards from the oldest one.
+   The writers of the shard move the tail under its lock, the readers of the flow move the head.
+*/
+typedef struct _flow_shard{
+   struct mutex lock; // writers of the shard
+   u32 head; // bytes read from the shard, headers included
+   u32 tail; // bytes written to the shard, headers included
+   u32 read; // bytes of data read from the shard
+   u32 written; // bytes of data written to the shard
+   u32 left; // bytes not read yet of the write at head, whose header was taken, under the readers lock
+   u64 stamp; // time of the write at head if left is not 0
+   u32 scan; // scan of the readers that took the header of the write at head
+   char *content; // ring buffer of shard_capacity bytes
+} flow_shard;
+
+#define SHARD_HEADER (2 * sizeof(u64))
+
 // Data struct that represents the device with its state and wait queues
 typedef struct _object_state{
    int minor; // minor of the dev
-   int prio; // 0 : high , 1 : low
-   int blocking; // 0 : blocking , 1 : non-blocking
-   int timeout;   // timeout for blocking operations
+   int debug; // 1 : log the operations on the dev
+   int prio; // 0 : high , 1 : low, default of the sessions opened
+   int blocking; // 0 : blocking , 1 : non-blocking, default of the sessions opened
+   u64 timeout;   // timeout in ns for blocking operations, default of the sessions opened
    wait_queue_head_t rd_queue[2];
-   wait_queue_head_t wt_queue[2]; // wait queues for read and write op
-   struct mutex operation_synchronizer[2]; // mutex for op sync
-   int valid_bytes[2]; // number of valid bytes in the two streams
-   char * stream_content[2];//the I/O node is a buffer in memory
+   wait_queue_head_t wt_queue[2]; // wait queues for read and write op, in FIFO order
+   wait_queue_head_t poll_queue[2]; // wait queues for poll on the two flows
+   struct mutex write_synchronizer[2]; // mutex of the writers of the two flows, they move the tail
+   struct mutex read_synchronizer[2]; // mutex of the readers of the two flows, they move the head
+   int capacity[2]; // size of the two ring buffers, a power of two
+   struct multi_flow_ring *ring[2]; // indices of the two streams, allocated on the first write and kept until unmount
+   char * stream_content[2];//the I/O node is a ring buffer in memory, allocated on the first write
+   atomic_t mapped[2]; // number of user mappings of the two streams
+   atomic_t sessions; // number of open sessions on the dev
+   atomic_t writers; // number of open sessions that can write
+   atomic_t readers; // number of open sessions that can read
+   int spsc; // 1 : single producer/single consumer mode, the only writer and the only reader skip the locks
+   atomic_t spsc_active[2]; // lockless writes (0) and reads (1) running
+   wait_queue_head_t spsc_queue; // wait queue to drain the lockless operations
+   flow_shard __percpu *shards; // sub-buffers of the high priority flow in sharded mode, NULL otherwise
+   int shard_capacity; // size of every sub-buffer
+   u32 shard_scan; // scans of the shards made by the readers, under the readers lock of the high priority flow
+   struct percpu_rw_semaphore shard_sem; // writers of the shards (read) against the change of the mode (write)
+   int record; // 0 : byte stream, 1 : records truncated when they do not fit, 2 : records rejected when they do not fit
+   int broadcast; // 0 : reads consume the data, >0 : every reader has its own cursor and lags at most broadcast bytes, under broadcast_lock
+   struct list_head subscribers; // sessions that can read, with their cursors
+   spinlock_t broadcast_lock; // lock of the subscribers and of the head of the flows in broadcast mode
+   int overwrite; // 1 : a write without room evicts the oldest data of the flow instead of waiting or being truncated
+   atomic_long_t overwritten[2]; // bytes, or messages in record mode, evicted from the two flows
+   atomic_t pending; // number of deferred writes not yet done
+   int pending_bytes; // bytes of the deferred writes not yet done, under deferred_lock
+   wait_queue_head_t pending_queue; // wait queue for writers over the deferred limits
+   unsigned long last_release; // jiffies of the last session closed
+   spinlock_t deferred_lock; // lock for the queue of deferred writes
+   struct list_head deferred_list; // deferred low priority writes not yet appended
+   struct delayed_work deferred_work; // work that appends the deferred writes, delayed to the deadline of a write waiting for room
+   int pending_max; // high-water mark of the deferred writes, under deferred_lock
+   int pending_bytes_max; // high-water mark of the deferred bytes, under deferred_lock
+   atomic_t waiting[2]; // number of readers sleeping on the two flows
+   flow_stats __percpu *stats; // counters of the operations on the dev
+   flow_latency *latency; // latency histograms of the dev
 } object_state;
 
 /*
    Struct used for delayed work.
-   It include the tasklet struct, info of the bytes to write
-   and the pointer "buffer" for the object_state
+   It include the link in the deferred queue of the dev, the time it was queued and the one it started to wait for room,
+   the settings of the session that wrote it, the number of bytes to write and the copy of the data
 */
 typedef struct _packed_task{
-        void* buffer;
-        const char* to_write;
+        struct list_head list;
+        ktime_t queued;
+        ktime_t wait_start; // 0 until the write does not fit in the flow
+        struct file *file; // session of the write, held until the write is done
+        int blocking; // settings of the session of the write, 1 if it was non-blocking when queued
+        u64 timeout;
+        ktime_t deadline; // end of the timeout from wait_start, 0 for no timeout
         int bytes_to_write;
-        struct tasklet_struct the_tasklet;
+        char to_write[];
 } packed_task;
 
+/*
+   State of an open session, in the private_data of the file.
+   The settings start from the ones of the dev when the session is opened and are changed only for the session.
+   In broadcast mode the cursors are the next byte of the two flows the session reads,
+   they are moved by the session under the readers lock of the flow and broadcast_lock.
+*/
+typedef struct _flow_session{
+   struct file *file; // file of the session, for O_NONBLOCK
+   int prio; // 0 : high , 1 : low
+   int blocking; // 0 : blocking , 1 : non-blocking, the file opened with O_NONBLOCK is always non-blocking
+   u64 timeout; // timeout in ns for blocking operations, 0 for none
+   u64 remaining; // ns left of the timeout at the end of the last blocking operation
+   int lowat; // bytes after which a blocking read returns what is valid, 0 to wait for the whole read
+   struct list_head link; // in the subscribers of the dev, if the session can read
+   int dropped; // 1 : the session lagged too much and lost data, under broadcast_lock
+   u32 cursor[2];
+} flow_session;
+
 
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
-int put_work(object_state *the_object,const char* buff,int len);
-void low_prio_write(unsigned long data);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static struct file_operations fops;
+int put_work(object_state *the_object,flow_session *session,struct iov_iter *from,int len,int nowait);
+void low_prio_write(struct work_struct *work);
 
 #define DEVICE_NAME "multi-flow-dev"
 
+/*
+   Logging of the operations, disabled by default and enabled per minor with the ioctl.
+   The static key is enabled only while some minor logs, otherwise every flow_log
+   is a single patched out jump and the arguments are not evaluated.
+*/
+static DEFINE_STATIC_KEY_FALSE(flow_debug_key);
+static DEFINE_MUTEX(flow_debug_mutex);
+
+#define flow_log(the_object, ...) \
+   do { \
+      if(static_branch_unlikely(&flow_debug_key) && READ_ONCE((the_object)->debug)){ \
+         printk(__VA_ARGS__); \
+      } \
+   } while(0)
+
+/* Update of the counters of the dev on the current cpu */
+#define flow_stat_inc(the_object, field, priority) this_cpu_inc((the_object)->stats->field[priority])
+#define flow_stat_add(the_object, field, priority, val) this_cpu_add((the_object)->stats->field[priority], val)
+
+/* Add the time elapsed since start to a latency histogram */
+static void flow_latency_record(atomic_long_t *histogram, ktime_t start){
+
+   s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+   int bucket = 0;
+
+   if(ns > 0){
+      bucket = min(ilog2(ns), LATENCY_BUCKETS - 1);
+   }
+   atomic_long_inc(&histogram[bucket]);
+}
+
+/* Kernels without non-blocking iocbs never set the flag */
+#ifndef IOCB_NOWAIT
+#define IOCB_NOWAIT 0
+#endif
+
 
 /* Major number assigned to broadcast device driver */
 static int Major;
@@ -91,6 +258,13 @@ module_param_array(bytes_high, int, NULL, 0440);
 static int bytes_low[MINORS]; 
 module_param_array(bytes_low, int, NULL, 0440);
 
+/* Number of deferred low priority writes and their bytes not yet appended for every minor */
+static int pending_low[MINORS]; 
+module_param_array(pending_low, int, NULL, 0440);
+
+static int pending_bytes_low[MINORS]; 
+module_param_array(pending_bytes_low, int, NULL, 0440);
+
 
 /* Number of thread waiting for data in the read wait queue (high and low priority) */
 static unsigned long high_wait_queue_counter[MINORS]; 
@@ -99,450 +273,3280 @@ module_param_array(high_wait_queue_counter, ulong, NULL, 0440);
 static unsigned long low_wait_queue_counter[MINORS]; 
 module_param_array(low_wait_queue_counter, ulong, NULL, 0440);
 
+/* Bytes, or messages in record mode, evicted from the flows in overwrite mode, the readers compare them to find the gaps */
+static unsigned long overwritten_high[MINORS];
+module_param_array(overwritten_high, ulong, NULL, 0440);
 
-/* Size of the two buffers of every device */
-#define OBJECT_MAX_SIZE  (4096)
-
+static unsigned long overwritten_low[MINORS];
+module_param_array(overwritten_low, ulong, NULL, 0440);
 
-/* Open operation of the driver */
-static int dev_open(struct inode *inode, struct file *file) {
+/* Update the readers sleeping on a flow and their module parameter */
+static void flow_waiting(object_state *the_object, int priority, int delta){
 
-   int minor;
-   minor = get_minor(file);
+   int waiting = atomic_add_return(delta,&(the_object->waiting[priority]));
 
-   // Check if minor number is supported
-   if(minor >= MINORS){
-	  return -ENODEV;
+   if(priority == 0){
+      WRITE_ONCE(high_wait_queue_counter[the_object->minor], waiting);
+   }else{
+      WRITE_ONCE(low_wait_queue_counter[the_object->minor], waiting);
    }
+}
 
-   // Check if permissions to open the session are enabled
-   if(open_permissions[minor] == 1){
-      return -ENODEV;
-   }
+/* Count the data evicted from a flow and update its module parameter */
+static void flow_overwritten(object_state *the_object, int priority, long count){
 
-   printk("%s: device file successfully opened for object with minor %d\n",MODNAME,minor);
+   long overwritten = atomic_long_add_return(count,&(the_object->overwritten[priority]));
 
-   return 0;
+   flow_stat_add(the_object,overwritten,priority,count);
+   if(priority == 0){
+      WRITE_ONCE(overwritten_high[the_object->minor], overwritten);
+   }else{
+      WRITE_ONCE(overwritten_low[the_object->minor], overwritten);
+   }
 }
 
-/* Release operation of the driver */
-static int dev_release(struct inode *inode, struct file *file) {
 
-   int minor;
-   minor = get_minor(file);
+/* Default size of the two buffers of every device */
+#define OBJECT_MAX_SIZE  (4096)
 
-   printk("%s: device file wit minor %d closed\n",MODNAME,minor);
-   //device closed by default nop
-   return 0;
+/* Workqueue of the deferred writes, unbound if deferred_wq_unbound is set */
+static struct workqueue_struct *deferred_wq;
+
+static int deferred_wq_unbound = 0;
+module_param(deferred_wq_unbound, int, 0440);
+
+/* Max deferred works running at the same time, 0 for the workqueue default */
+static int deferred_wq_max_active = 0;
+module_param(deferred_wq_max_active, int, 0440);
+
+/* Limits of deferred writes and bytes queued on every minor, a write over them waits or fails with -EAGAIN */
+static int deferred_max_writes = 64;
+module_param(deferred_max_writes, int, 0660);
+
+static int deferred_max_bytes = 64 * OBJECT_MAX_SIZE;
+module_param(deferred_max_bytes, int, 0660);
+
+/* Seconds a minor must be unopened with empty flows before its buffers are released, 0 to keep them */
+static int idle_reclaim_secs = 30;
+module_param(idle_reclaim_secs, int, 0440);
+
+/* Upper bound for the size of a buffer, both at load time and with the resize ioctl */
+#define OBJECT_CAPACITY_LIMIT  (64 << 20)
+
+/* Size of the two buffers of every device at load time, rounded up to a power of two of at least one page */
+static int flow_capacity = OBJECT_MAX_SIZE;
+module_param(flow_capacity, int, 0440);
+
+
+/* Number of valid bytes in the ring buffer of the flow, it can be called without the locks of the flow */
+static int ring_valid(object_state *the_object, int priority){
+
+   struct multi_flow_ring *ring;
+   u32 head, tail;
+
+   ring = smp_load_acquire(&(the_object->ring[priority]));
+   if(ring == NULL){
+      return 0;
+   }
+
+   // Load head first, so the reader can not move it past the loaded tail
+   head = smp_load_acquire(&(ring->head));
+   tail = smp_load_acquire(&(ring->tail));
 
+   return clamp_t(int, (int)(tail - head), 0, READ_ONCE(the_object->capacity[priority]));
 }
 
+/* Number of bytes taken in a shard, with the headers of the writes */
+static int shard_valid(object_state *the_object, flow_shard *shard){
 
-/* Write operation of the driver */
-static ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t *off) {
+   u32 head, tail;
 
-  int minor = get_minor(filp);
-  int ret = 0;
-  object_state *the_object;
-  int priority;
+   head = smp_load_acquire(&(shard->head));
+   tail = smp_load_acquire(&(shard->tail));
 
-  the_object = objects + minor;
+   return clamp_t(int, (int)(tail - head), 0, the_object->shard_capacity);
+}
 
-  // Check if there is nothing to write
-  if(len == 0){
-   return 0;
-  }
+/* Number of bytes of data in a shard, the writer publishes the tail before them */
+static int shard_data(object_state *the_object, flow_shard *shard){
 
-  // Check the priority of the device
-  priority = the_object->prio;
+   u32 read, written;
 
-retry_write_high:
+   read = smp_load_acquire(&(shard->read));
+   written = smp_load_acquire(&(shard->written));
 
-  if(priority == 1){
-      printk("%s: somebody called a low priority write on dev with [major,minor] number [%d,%d] starting from offest %d with priority %d\n",MODNAME,get_major(filp),get_minor(filp),the_object->valid_bytes[1],priority);
-      put_work(the_object,buff,len);
-  }else if (priority == 0){
-
-      // Get the lock for opertion on the device
-      mutex_lock(&(the_object->operation_synchronizer[priority])); 
-      printk("%s: called high priority write on dev with minor %d, starting from offest %d with priority %d\n",MODNAME,get_minor(filp),the_object->valid_bytes[priority],priority);
-
-      // Check if the write reaches memory bound,then resize the write or go on wait_queue
-      if(the_object->valid_bytes[priority] + len > OBJECT_MAX_SIZE){
-
-         // Case object is blocking
-         if(the_object->blocking == 0){
-            // Release the lock for operations
-            mutex_unlock(&(the_object->operation_synchronizer[priority]));
-            printk("%s : Insufficient space on high priority buffer to write on dev with [major,minor] number [%d,%d]\n",MODNAME,get_major(filp),get_minor(filp));
-            
-            // Check timeout value to go in wait queue
-            if(the_object->timeout > 0){
-               // Going sleep with timeout
-               printk("%s : go to sleep for high priority write on dev %d with timeout %d s\n",MODNAME,get_minor(filp),the_object->timeout);
-               ret = wait_event_timeout(the_object->wt_queue[priority], the_object->blocking || (the_object->valid_bytes[priority] + len) <= OBJECT_MAX_SIZE, the_object->timeout*HZ);
-            }else{
-               // Going sleep without timeout
-               printk("%s : go to sleep for high priority write on dev %d without timeout\n",MODNAME,get_minor(filp));
-               wait_event(the_object->wt_queue[priority], the_object->blocking || the_object->valid_bytes[priority] + len <= OBJECT_MAX_SIZE);
-            }
+   return clamp_t(int, (int)(written - read), 0, the_object->shard_capacity);
+}
 
-         // retry write when wake up from wait queue
-         goto retry_write_high;
-         }
-         else if (the_object->blocking == 1){ // Case object is non-blocking
-            // Set the len of bytes to write to max remaining bytes
-            len = OBJECT_MAX_SIZE - the_object->valid_bytes[priority];
+/* Number of bytes of data a write can store in a shard, after its header */
+static int shard_free(object_state *the_object, flow_shard *shard){
+
+   return max_t(int, the_object->shard_capacity - shard_valid(the_object,shard) - (int)SHARD_HEADER, 0);
+}
+
+/*
+   Number of valid bytes in the flow, it can be called without the locks of the flow.
+   In sharded mode the high priority flow also holds the bytes of all the shards,
+   they are freed after a grace period so they can be read under rcu_read_lock.
+*/
+static int flow_valid(object_state *the_object, int priority){
+
+   flow_shard __percpu *shards;
+   int valid = ring_valid(the_object, priority);
+   int cpu;
+
+   if(priority == 0 && READ_ONCE(the_object->shards) != NULL){
+      rcu_read_lock();
+      shards = smp_load_acquire(&(the_object->shards));
+      if(shards != NULL){
+         for_each_possible_cpu(cpu){
+            valid += shard_data(the_object, per_cpu_ptr(shards, cpu));
          }
-         
       }
+      rcu_read_unlock();
+   }
 
-      // Copy data from user buffer to kernel buffer
-      ret = copy_from_user(&(the_object->stream_content[priority][the_object->valid_bytes[priority]]),buff,len);
-      if(ret != 0){
-         printk("%s : Error in high priority write, could only write %ld bytes of %ld",MODNAME,len-ret,len);
+   return valid;
+}
+
+/*
+   Number of free bytes in the flow, it can be called without the locks of the flow.
+   In sharded mode the high priority flow has the free bytes of the shard of the current cpu.
+*/
+static int flow_free(object_state *the_object, int priority){
+
+   flow_shard __percpu *shards;
+   int free = -1;
+
+   if(priority == 0 && READ_ONCE(the_object->shards) != NULL){
+      rcu_read_lock();
+      shards = smp_load_acquire(&(the_object->shards));
+      if(shards != NULL){
+         free = shard_free(the_object, raw_cpu_ptr(shards));
       }
+      rcu_read_unlock();
+      if(free >= 0){
+         return free;
+      }
+   }
 
-      // Update valid bytes in the buffer
-      the_object->valid_bytes[priority] = the_object->valid_bytes[priority] + (len - ret);
+   return READ_ONCE(the_object->capacity[priority]) - ring_valid(the_object, priority);
+}
 
-      // Update module parameter array of valid bytes
-      bytes_high[minor] = the_object->valid_bytes[priority];
+/*
+   Number of bytes the session can read from the flow, it can be called without the locks of the flow.
+   In broadcast mode they go from the cursor of the session to the tail.
+*/
+static int session_valid(object_state *the_object, int priority, flow_session *session){
 
-      // Wake up process waiting in read queue with high priority
-      wake_up_all(&(the_object->rd_queue[priority]));
+   struct multi_flow_ring *ring;
 
-      printk("%s: Done high priority write. Valid bytes are now %d on dev with [major,minor] number [%d,%d]\n",MODNAME,the_object->valid_bytes[priority],get_major(filp),get_minor(filp));
+   if(!READ_ONCE(the_object->broadcast) || session == NULL){
+      return flow_valid(the_object, priority);
+   }
 
-      // Release the lock fo operations on the device
-      mutex_unlock(&(the_object->operation_synchronizer[priority]));
+   ring = smp_load_acquire(&(the_object->ring[priority]));
+   if(ring == NULL){
+      return 0;
    }
 
-  // Return the written bytes
-  return len - ret;
+   return clamp_t(int, (int)(smp_load_acquire(&(ring->tail)) - READ_ONCE(session->cursor[priority])), 0, READ_ONCE(the_object->capacity[priority]));
+}
+
+/* 1 if the operations of the session do not sleep, set with the ioctl or with O_NONBLOCK */
+static int session_nonblocking(flow_session *session){
 
+   return READ_ONCE(session->blocking) == 1 || (READ_ONCE(session->file->f_flags) & O_NONBLOCK);
 }
 
-/* Read operation of the driver */
-static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off) {
+/* Bytes a blocking read of len bytes waits for, the low watermark of the session if it is smaller */
+static size_t session_need(flow_session *session, size_t len){
 
-  int minor = get_minor(filp);
-  int ret;
-  object_state *the_object;
-  char *tmpbuff =  (char*)__get_free_page(GFP_KERNEL);
-  int priority;
-  atomic_t *counter;
+   int lowat = READ_ONCE(session->lowat);
 
-  the_object = objects + minor;
+   return lowat > 0 ? min_t(size_t, len, lowat) : len;
+}
 
-  // Check the priority of the operation
-  priority = the_object->prio;
+/*
+   Waiter in the read or write queue of a flow, with the bytes it needs to be valid or free.
+   The queues are in FIFO order and a wake up gives the available bytes to the waiters from the first one,
+   so only the ones that can complete are woken.
+*/
+typedef struct _flow_waiter{
+   wait_queue_entry_t wait;
+   size_t need;
+} flow_waiter;
 
-retry_read:
-  // Get the lock for opertion on the device
-  mutex_lock(&(the_object->operation_synchronizer[priority])); 
-  printk("%s: somebody called a read of %ld bytes on flow with priority %d, on dev with [major,minor] number [%d,%d]\n",MODNAME,len,priority,get_major(filp),get_minor(filp));
+// Key of a targeted wake up: the bytes that can be given to the waiters and the size of the buffer
+typedef struct _flow_wake_key{
+   size_t available;
+   size_t capacity;
+} flow_wake_key;
 
-  /*
-      Resize the reading len if major then then the valid bytes,
-      or go to sleep in read waiting queues.
-  */
-  if(len > the_object->valid_bytes[priority]){
+/*
+   Wake function of the waiters, without key (wake_up_all) every waiter is woken.
+   A waiter stays in the queue until it leaves flow_wait, so a waiter woken but not yet running
+   still takes its bytes and the ones behind it are not woken for the same data.
+*/
+static int flow_wake_function(wait_queue_entry_t *wait, unsigned mode, int sync, void *key){
 
-      // Case object is blocking
-      if(the_object->blocking == 0){
-         // Release the lock for operations
-         mutex_unlock(&(the_object->operation_synchronizer[priority]));
-         printk("%s : Insufficient number of bytes to read on flow with priority %d, on dev with [major,minor] number [%d,%d]\n",MODNAME,priority,get_major(filp),get_minor(filp));
-         
-         // Increase counter in the module parameter array of thread waiting for data 
-         if(priority == 0){
-            counter = (atomic_t*)&high_wait_queue_counter[minor];
-         }else if (priority == 1){
-            counter = (atomic_t*)&low_wait_queue_counter[minor];
-         }
-         atomic_inc(counter);
-
-         // Check timeout value to go in wait queue
-         if(the_object->timeout > 0){
-            // Going sleep with timeout
-            printk("%s : go to sleep for read with priority %d on dev %d with timeout %d s\n",MODNAME,priority,get_minor(filp),the_object->timeout);
-            wait_event_timeout(the_object->rd_queue[priority], the_object->blocking || len <= the_object->valid_bytes[priority], the_object->timeout*HZ);
-         }else{
-            // Going sleep without timeout
-            printk("%s : go to sleep for read with priority %d on dev %d without timeout\n",MODNAME,priority,get_minor(filp));
-            wait_event(the_object->rd_queue[priority], the_object->blocking || len <= the_object->valid_bytes[priority]);
-         }
+   flow_waiter *waiter = container_of(wait, flow_waiter, wait);
+   flow_wake_key *budget = key;
 
-         // Decrease counter in the module parameter array of thread waiting for data 
-         atomic_dec(counter);
-         goto retry_read;
-      }else if (the_object->blocking == 1){ // Case object is non-blocking
-         // Set the len of bytes to read to max readable bytes
-         len = the_object->valid_bytes[priority];
-      }   
-  }
+   if(budget != NULL){
+      // It could never be satisfied, do not stop the others behind it
+      if(waiter->need > budget->capacity){
+         return 0;
+      }
+      // Strict FIFO, the next waiters wait behind the first one that does not fit
+      if(waiter->need > budget->available){
+         return -1;
+      }
+      budget->available -= waiter->need;
+   }
 
-  // Copy data from kernel buffer to user buffer
-  ret = copy_to_user(buff,the_object->stream_content[priority],len);
+   return default_wake_function(wait, mode, sync, key);
+}
 
-  // Update the valid bytes count in the stream
-  the_object->valid_bytes[priority] = the_object->valid_bytes[priority] - len - ret;
+static void flow_wake_readers(object_state *the_object, int priority);
+static void flow_wake_writers(object_state *the_object, int priority);
 
-  // Update parameter array of valid bytes
-  if(priority == 0){
-   bytes_high[minor] = the_object->valid_bytes[priority];
-  }else if (priority == 1){
-   bytes_low[minor] = the_object->valid_bytes[priority];
-  }
+/*
+   Deadline of a blocking operation that starts to wait now, with a timeout in ns, 0 for no timeout.
+   A timeout past the range of ktime_t, e.g. U64_MAX for forever, saturates to the end of it.
+*/
+static ktime_t flow_deadline(u64 timeout){
 
-  // Delete the read bytes from the stream
-  memcpy(tmpbuff,the_object->stream_content[priority] + len,OBJECT_MAX_SIZE-len);
-  memset(the_object->stream_content[priority],0,OBJECT_MAX_SIZE);
-  memcpy(the_object->stream_content[priority],tmpbuff,OBJECT_MAX_SIZE);
-  free_page((unsigned long)tmpbuff);
+   return timeout > 0 ? ktime_add_safe(ktime_get(), ns_to_ktime(min_t(u64, timeout, KTIME_MAX))) : 0;
+}
 
-  // Wake up process waiting in write queue of the appropriate priority
-  wake_up_all(&(the_object->wt_queue[priority]));
+/* Store the time left before the deadline of the operation, read back by the caller with the ioctl */
+static void session_remaining(flow_session *session, ktime_t deadline){
 
-  printk("%s: Done read with priority %d. Valid bytes are now %d on dev with [major,minor] number [%d,%d]\n",MODNAME,priority,the_object->valid_bytes[priority],get_major(filp),get_minor(filp));
-  
-  // Release the lock for operations on the device
-  mutex_unlock(&(the_object->operation_synchronizer[priority]));
-  
-  // Return the read bytes
-  return len - ret;
+   s64 left = ktime_to_ns(ktime_sub(deadline, ktime_get()));
+
+   WRITE_ONCE(session->remaining, left > 0 ? left : 0);
 }
 
-/* ioctl operation of the driver */
-static long dev_ioctl(struct file *filp, unsigned int command, unsigned long param) {
+/*
+   Sleep on the read (write 0) or write (write 1) queue of a flow until need bytes are valid for the session or free,
+   the session becomes non-blocking or the deadline expires, 0 for no deadline.
+   The sleep is bounded by a hrtimer, so the timeouts are not rounded to the jiffies.
+   Return 1 if the deadline expired.
+*/
+static int flow_wait(object_state *the_object, int priority, int write, size_t need, ktime_t deadline, flow_session *session){
+
+   wait_queue_head_t *queue = write ? &(the_object->wt_queue[priority]) : &(the_object->rd_queue[priority]);
+   flow_waiter waiter;
+   int expired = 0;
+   int done;
+
+   init_wait_entry(&(waiter.wait), 0);
+   waiter.wait.func = flow_wake_function;
+   waiter.need = need;
+
+   for(;;){
+      // Added to the tail only the first time, a spurious wake up keeps the place in the queue
+      prepare_to_wait_exclusive(queue, &(waiter.wait), TASK_UNINTERRUPTIBLE);
+      // In overwrite mode a writer makes room by itself
+      done = session_nonblocking(session) || (write && READ_ONCE(the_object->overwrite)) ||
+         need <= (write ? flow_free(the_object,priority) : session_valid(the_object,priority,session));
+      if(done || expired){
+         break;
+      }
+      // The slack of the task lets the timer expire together with others, as for poll and nanosleep
+      if(deadline == 0){
+         schedule();
+      }else{
+         expired = schedule_hrtimeout_range(&deadline, current->timer_slack_ns, HRTIMER_MODE_ABS) == 0;
+      }
+   }
+   finish_wait(queue, &(waiter.wait));
+
+   // A waiter that leaves without its bytes, by timeout or turning non-blocking, stopped the wake ups of the ones behind it
+   if(need > (write ? flow_free(the_object,priority) : session_valid(the_object,priority,session))){
+      if(write){
+         flow_wake_writers(the_object,priority);
+      }else{
+         flow_wake_readers(the_object,priority);
+      }
+   }
 
-  int minor = get_minor(filp);
-  object_state *the_object;
+   return !done;
+}
 
-  the_object = objects + minor;
+/* Wake up the readers of a flow that the valid bytes can satisfy, and the pollers */
+static void flow_wake_readers(object_state *the_object, int priority){
 
-  /*
-   List of commands:
-      0 : change priority for a given minor
-      1 : change timeout for a given minor
-      3 : blocking/non-blocking operations for a given minor
-  */
+   flow_wake_key key;
 
-  // Called change priority
-  if(command == 0){
-      int *priority = (int*)param;
-      printk("%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update priority with value %d\n",MODNAME,get_major(filp),get_minor(filp),*priority);
-      // Update priority of the specific minor
-      the_object->prio = *priority;
-  }else if (command == 1){
-      int *timer = (int*)param;
-      printk("%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update wait queue timeout with value %d\n",MODNAME,get_major(filp),get_minor(filp),*timer);
-      // Update priority of the specific minor
-      the_object->timeout = *timer;
-  }else if (command == 3){
-      int *block = (int*)param;
-      printk("%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update blocking param with value %d\n",MODNAME,get_major(filp),get_minor(filp),*block);
-      // Update priority of the specific minor
-      the_object->blocking = *block;
-      
-      // Check if call wake up all the wait queues
-      if(the_object->blocking == 1){
-         wake_up_all(&(the_object->rd_queue[0]));
-         wake_up_all(&(the_object->rd_queue[1]));
-         wake_up_all(&(the_object->wt_queue[0]));
-         wake_up_all(&(the_object->wt_queue[1]));
+   // The barrier of wq_has_sleeper pairs with the one of the waiter between joining the queue and checking the flow
+   if(wq_has_sleeper(&(the_object->rd_queue[priority]))){
+      if(READ_ONCE(the_object->broadcast)){
+         // Every subscriber reads the same data
+         __wake_up(&(the_object->rd_queue[priority]), TASK_NORMAL, 0, NULL);
+      }else{
+         key.available = flow_valid(the_object,priority);
+         key.capacity = READ_ONCE(the_object->capacity[priority]);
+         __wake_up(&(the_object->rd_queue[priority]), TASK_NORMAL, 0, &key);
+      }
    }
-  }else{
-      // Invalid command
-      printk("%s : Called an ioctl on dev with [major,minor] number [%d,%d] with invalid command %u\n",MODNAME,get_major(filp),get_minor(filp),command);
-  }
+   if(wq_has_sleeper(&(the_object->poll_queue[priority]))){
+      wake_up_poll(&(the_object->poll_queue[priority]), EPOLLIN | EPOLLRDNORM);
+   }
+}
 
-  return 0;
+/*
+   Run the work of the deferred writes of the dev again if some are pending,
+   the ones that did not fit in the low priority flow stay queued until the readers free room.
+*/
+static void deferred_kick(object_state *the_object){
 
+   // Pairs with the barrier of queue_work between reserving a deferred write and the work checking the free bytes
+   smp_mb();
+   if(atomic_read(&(the_object->pending)) != 0){
+      mod_delayed_work(deferred_wq,&(the_object->deferred_work),0);
+   }
 }
 
-// Function used to queue delayed write using tasklets
-int put_work(object_state *the_object,const char* buff,int len){
+/* Wake up the writers of a flow that the free bytes can satisfy, and the pollers */
+static void flow_wake_writers(object_state *the_object, int priority){
 
-   packed_task *the_task;
+   flow_wake_key key;
 
-   // Try to lock module
-   if(!try_module_get(THIS_MODULE)) return -ENODEV;
+   if(wq_has_sleeper(&(the_object->wt_queue[priority]))){
+      if(priority == 0 && READ_ONCE(the_object->shards) != NULL){
+         // Every writer waits for the shard of its own cpu, the free bytes here are of another one
+         __wake_up(&(the_object->wt_queue[priority]), TASK_NORMAL, 0, NULL);
+      }else{
+         key.available = flow_free(the_object,priority);
+         key.capacity = READ_ONCE(the_object->capacity[priority]);
+         __wake_up(&(the_object->wt_queue[priority]), TASK_NORMAL, 0, &key);
+      }
+   }
+   if(wq_has_sleeper(&(the_object->poll_queue[priority]))){
+      wake_up_poll(&(the_object->poll_queue[priority]), EPOLLOUT | EPOLLWRNORM);
+   }
+   if(priority == 1){
+      deferred_kick(the_object);
+   }
+}
 
+/*
+   Single producer/single consumer mode: while the dev has one session that can write,
+   its high priority writes run without the writers lock, and while it has one session
+   that can read, its reads run without the readers lock. Each side moves only its own index
+   with release semantics, so the lockless side needs no lock as long as it is alone.
+   An operation that would sleep, or that finds the lock of its side taken by another thread
+   of the same session, takes the locked path, and the locked path waits for the lockless one.
+   Enter the lockless path of the writers (side 0) or of the readers (side 1) of the flow, return 1 if taken.
+*/
+static int spsc_enter(object_state *the_object, int side, int priority){
 
-   printk("%s: requested deferred write on dev with minor %d\n",MODNAME,the_object->minor);
+   if(!READ_ONCE(the_object->spsc)){
+      return 0;
+   }
 
-   // Alloc memory for the tasklet struct
-   the_task = kzalloc(sizeof(packed_task),GFP_ATOMIC);//non blocking memory allocation
-   if (the_task == NULL) {
-      printk("%s: tasklet buffer allocation failure\n",MODNAME);
-      module_put(THIS_MODULE);
-      return -1;
+   // Pairs with the barrier of spsc_drain: either the new session is seen here or it waits for this operation
+   if(atomic_inc_return(&(the_object->spsc_active[side])) == 1){
+      // The buffer seen after the mode is the one of the mode, see dev_ioctl
+      // Pairs with the barrier of spsc_exclude: either the lock is seen here or the locked path waits for this operation
+      if(smp_load_acquire(&(the_object->spsc)) &&
+         atomic_read(side == 0 ? &(the_object->writers) : &(the_object->readers)) == 1 &&
+         !mutex_is_locked(side == 0 ? &(the_object->write_synchronizer[priority]) : &(the_object->read_synchronizer[priority]))){
+         return 1;
+      }
    }
 
-   // Prepare the struct
-   the_task->buffer = (void*)the_object;
-   the_task->to_write = buff;
-   the_task->bytes_to_write = len;
+   // Another session or another thread on this side, use the locks
+   atomic_dec(&(the_object->spsc_active[side]));
+   if(waitqueue_active(&(the_object->spsc_queue))){
+      wake_up_all(&(the_object->spsc_queue));
+   }
+   return 0;
+}
+
+static void spsc_exit(object_state *the_object, int side){
 
+   // atomic_dec_and_test is a full barrier, the waiter in spsc_drain is seen
+   if(atomic_dec_and_test(&(the_object->spsc_active[side])) && waitqueue_active(&(the_object->spsc_queue))){
+      wake_up_all(&(the_object->spsc_queue));
+   }
+}
 
-   printk("%s: tasklet buffer allocation success - address is %p\n",MODNAME,the_task);
+/* Wait for the lockless operations running, the new ones see the change made before */
+static void spsc_drain(object_state *the_object){
 
-   // Inizialize tasklet struct
-   tasklet_init(&the_task->the_tasklet,low_prio_write,(unsigned long)the_task);
+   smp_mb();
+   wait_event(the_object->spsc_queue, atomic_read(&(the_object->spsc_active[0])) == 0 && atomic_read(&(the_object->spsc_active[1])) == 0);
+}
 
-   // Schedule the task in the tasklet queue
-   tasklet_schedule(&the_task->the_tasklet);
+/*
+   Called by the locked path of a side once it holds the lock: two threads of the only session of the side
+   can not move the index together, so the lockless operation started before the lock finishes first
+   and the ones starting later see the lock. The mode does not change while the lock is held.
+*/
+static void spsc_exclude(object_state *the_object, int side){
 
-   return 0;
+   if(!READ_ONCE(the_object->spsc)){
+      return;
+   }
+   smp_mb();
+   wait_event(the_object->spsc_queue, atomic_read(&(the_object->spsc_active[side])) == 0);
 }
 
-// Delayed work for the low priority write
-void low_prio_write(unsigned long data){
+/*
+   Writers and readers of a flow take different locks: a writer only moves the tail and a reader only the head,
+   and each side sees the index of the other one through flow_valid/flow_free, so a write and a read
+   on the same flow, with their user copies, run in parallel.
+   Replacing or releasing the buffer of the flow takes both, the writers one first.
+*/
+static void flow_lock(object_state *the_object, int priority){
 
-   int ret;
-   object_state *the_object = (object_state*)(((packed_task*)data)->buffer);
-   size_t len = ((packed_task*)data)->bytes_to_write;
-   const char* buff = ((packed_task*)data)->to_write;
-   int minor = the_object->minor;
+   mutex_lock(&(the_object->write_synchronizer[priority]));
+   mutex_lock(&(the_object->read_synchronizer[priority]));
+}
 
-retry_write_low:
-   // Get the lock for opertion on the device
-   mutex_lock(&(the_object->operation_synchronizer[1])); 
-   printk("%s: called low priority write on dev with minor %d, starting from offest %d\n",MODNAME,the_object->minor,the_object->valid_bytes[1]);
+static int flow_trylock(object_state *the_object, int priority){
+
+   if(!mutex_trylock(&(the_object->write_synchronizer[priority]))){
+      return 0;
+   }
+   if(!mutex_trylock(&(the_object->read_synchronizer[priority]))){
+      mutex_unlock(&(the_object->write_synchronizer[priority]));
+      return 0;
+   }
+   return 1;
+}
 
-   // Check if the write reaches memory bound,then resize the write or go on wait_queue
-   if(the_object->valid_bytes[1] + len > OBJECT_MAX_SIZE){
+static void flow_unlock(object_state *the_object, int priority){
 
-      // Case object is blocking
-      if(the_object->blocking == 0){
+   mutex_unlock(&(the_object->read_synchronizer[priority]));
+   mutex_unlock(&(the_object->write_synchronizer[priority]));
+}
 
-         // Release the lock for operations
-         mutex_unlock(&(the_object->operation_synchronizer[1]));
-         printk("%s : Insufficient space of buffer to write low priority on dev with minor number %d\n",MODNAME,minor);
-            
-         // Check timeout value to go in wait queue
-         if(the_object->timeout > 0){
-            // Going sleep with timeout
-            printk("%s : go to sleep for low priority write on dev %d with timeout %d s\n",MODNAME,the_object->minor,the_object->timeout);
-            ret = wait_event_timeout(the_object->wt_queue[1], the_object->blocking || the_object->valid_bytes[1] + len <= OBJECT_MAX_SIZE, the_object->timeout*HZ);
-         }else{
-            // Going sleep without timeout
-            printk("%s : go to sleep for low priority write on dev %d without timeout\n",MODNAME,the_object->minor);
-            wait_event(the_object->wt_queue[1], the_object->blocking || the_object->valid_bytes[1] + len <= OBJECT_MAX_SIZE);
-         }
+/*
+   Allocate the ring buffer of the flow if it was never used or has been reclaimed.
+   The control block with the indices is allocated only once and kept until unmount,
+   so the indices can always be read without the locks of the flow.
+   With nowait it fails with -EAGAIN instead of allocating, vmalloc can sleep in reclaim whatever the flags,
+   and the retry that can sleep allocates. The caller must hold the writers lock of the flow.
+*/
+static int ring_alloc(object_state *the_object, int priority, int nowait){
 
-      // retry write when wake up from wait queue
-      goto retry_write_low;
-      }
-      else if (the_object->blocking == 1){ // Case object is non-blocking
-         // Set the len of bytes to write to max remaining bytes
-         len = OBJECT_MAX_SIZE - the_object->valid_bytes[1];
+   struct multi_flow_ring *ring;
+
+   if(nowait && (the_object->ring[priority] == NULL || the_object->stream_content[priority] == NULL)){
+      return -EAGAIN;
+   }
+
+   if(the_object->ring[priority] == NULL){
+      ring = vmalloc_user(PAGE_SIZE);
+      if(ring == NULL){
+         printk("%s: control block allocation failure for flow with priority %d on dev with minor %d\n",MODNAME,priority,the_object->minor);
+         return -ENOMEM;
       }
+      ring->capacity = the_object->capacity[priority];
+      ring->data_offset = PAGE_SIZE;
+      smp_store_release(&(the_object->ring[priority]), ring);
    }
 
+   if(the_object->stream_content[priority] != NULL){
+      return 0;
+   }
 
-   // Copy data from user buffer to kernel buffer
-   ret = copy_from_user(&(the_object->stream_content[1][the_object->valid_bytes[1]]),buff,len);
-   if(ret != 0){
-      printk("%s : Error in delayed low prio write, could only write %ld bytes of %ld",MODNAME,len-ret,len);
+   the_object->stream_content[priority] = vmalloc_user(the_object->capacity[priority]);
+   if(the_object->stream_content[priority] == NULL){
+      printk("%s: buffer allocation failure for flow with priority %d on dev with minor %d\n",MODNAME,priority,the_object->minor);
+      return -ENOMEM;
    }
-  
-   // Update valid bytes in the buffer
-   the_object->valid_bytes[1] = the_object->valid_bytes[1] + (len - ret);
 
-   // Update parameter array of valid bytes
-   bytes_low[minor] = the_object->valid_bytes[1];
+   return 0;
+}
 
-   
-   // Wake up process waiting in read queue low prio
-   wake_up_all(&(the_object->rd_queue[1]));
+/*
+   Release the ring buffer of the flow if it is empty, no session is open on the dev,
+   it is not mapped, not in spsc or sharded mode and no deferred write is pending. With check_idle the dev must
+   also be closed since at least idle_reclaim_secs seconds.
+   It only tries the locks of the flow, so it is safe from the shrinker.
+   Return the number of pages released.
+*/
+static unsigned long ring_reclaim(object_state *the_object, int priority, int check_idle){
 
-   printk("%s: Done low priority write. Valid bytes are now %d on dev with minor %d\n",MODNAME,the_object->valid_bytes[1],the_object->minor);
+   char *content;
+   int capacity;
 
-  // Release the lock for operations on the device
-   mutex_unlock(&(the_object->operation_synchronizer[1]));
+   if(!flow_trylock(the_object,priority)){
+      return 0;
+   }
+
+   content = the_object->stream_content[priority];
+   capacity = the_object->capacity[priority];
+   if(content == NULL || ring_valid(the_object,priority) != 0 ||
+      atomic_read(&the_object->sessions) != 0 || atomic_read(&the_object->pending) != 0 ||
+      atomic_read(&the_object->mapped[priority]) != 0 || the_object->spsc || (priority == 0 && the_object->shards != NULL) ||
+      (check_idle && time_before(jiffies, the_object->last_release + idle_reclaim_secs*HZ))){
+      flow_unlock(the_object,priority);
+      return 0;
+   }
+
+   the_object->stream_content[priority] = NULL;
 
-   kfree((void*)data);
+   flow_unlock(the_object,priority);
 
-   // Release lock module
-   module_put(THIS_MODULE);
+   vfree(content);
 
+   return capacity >> PAGE_SHIFT;
 }
 
-static struct file_operations fops = {
-  .owner = THIS_MODULE,
-  .write = dev_write,
-  .read = dev_read,
-  .open =  dev_open,
-  .release = dev_release,
-  .unlocked_ioctl = dev_ioctl
-};
+/*
+   Copy len bytes at the byte index of a ring buffer of capacity bytes, a power of two, wrapping around the end,
+   from the user segments or from data if from is NULL. The flows and the shards store their bytes with it.
+   Return the number of bytes copied.
+*/
+static size_t wrap_store(char *content, u32 capacity, u32 index, struct iov_iter *from, const void *data, size_t len){
 
+   u32 offset = index & (capacity - 1);
+   size_t first = min_t(size_t, len, capacity - offset);
+   size_t copied;
 
+   if(from == NULL){
+      memcpy(content + offset, data, first);
+      memcpy(content, data + first, len - first);
+      return len;
+   }
 
-int init_module(void) {
+   copied = copy_from_iter(content + offset, first, from);
+   if(copied == first){
+      copied += copy_from_iter(content, len - first, from);
+   }
+   return copied;
+}
 
-	int i;
+/*
+   Copy len bytes from the byte index of a ring buffer of capacity bytes, wrapping around the end,
+   to the user segments or to data if to is NULL.
+   Return the number of bytes copied.
+*/
+static size_t wrap_load(const char *content, u32 capacity, u32 index, struct iov_iter *to, void *data, size_t len){
 
-	//initialize the drive internal state
-	for(i=0;i<MINORS;i++){
-		mutex_init(&(objects[i].operation_synchronizer[0]));
-      mutex_init(&(objects[i].operation_synchronizer[1]));
-      init_waitqueue_head(&(objects[i].rd_queue[0]));
-      init_waitqueue_head(&(objects[i].rd_queue[1]));
-      init_waitqueue_head(&(objects[i].wt_queue[0]));
-      init_waitqueue_head(&(objects[i].wt_queue[1]));
-		objects[i].valid_bytes[0] = 0;
-      objects[i].valid_bytes[1] = 0;
-      objects[i].prio = 0; // Init with high priority
-      objects[i].minor = i;
+   u32 offset = index & (capacity - 1);
+   size_t first = min_t(size_t, len, capacity - offset);
+   size_t copied;
+
+   if(to == NULL){
+      memcpy(data, content + offset, first);
+      memcpy(data + first, content, len - first);
+      return len;
+   }
+
+   copied = copy_to_iter(content + offset, first, to);
+   if(copied == first){
+      copied += copy_to_iter(content, len - first, to);
+   }
+   return copied;
+}
+
+/* Copy len bytes at the byte index of the ring buffer of the flow, from the user segments or from data if from is NULL */
+static size_t ring_store(object_state *the_object, int priority, u32 index, struct iov_iter *from, const void *data, size_t len){
+
+   return wrap_store(the_object->stream_content[priority],the_object->capacity[priority],index,from,data,len);
+}
+
+/* Copy len bytes from the byte index of the ring buffer of the flow, to the user segments or to data if to is NULL */
+static size_t ring_load(object_state *the_object, int priority, u32 index, struct iov_iter *to, void *data, size_t len){
+
+   return wrap_load(the_object->stream_content[priority],the_object->capacity[priority],index,to,data,len);
+}
+
+/*
+   Copy len bytes from the user segments to the tail of the ring buffer of the flow
+   and publish the bytes copied to the readers.
+   The caller must hold the writers lock of the flow and check the free space.
+   Return the number of bytes copied.
+*/
+static size_t ring_write(object_state *the_object, int priority, struct iov_iter *from, size_t len){
+
+   struct multi_flow_ring *ring = the_object->ring[priority];
+   size_t copied;
+
+   copied = ring_store(the_object,priority,ring->tail,from,NULL,len);
+   smp_store_release(&(ring->tail), ring->tail + (u32)copied);
+
+   return copied;
+}
+
+/*
+   Copy len bytes from a kernel buffer to the tail of the ring buffer of the flow
+   and publish them to the readers.
+   The caller must hold the writers lock of the flow and check the free space.
+*/
+static void ring_append(object_state *the_object, int priority, const char *data, size_t len){
+
+   struct multi_flow_ring *ring = the_object->ring[priority];
+
+   ring_store(the_object,priority,ring->tail,NULL,data,len);
+   smp_store_release(&(ring->tail), ring->tail + (u32)len);
+}
+
+/*
+   Copy len bytes from the head of the ring buffer of the flow to the user segments
+   and give the space of the bytes copied back to the writers.
+   The caller must hold the readers lock of the flow and check the valid bytes.
+   Return the number of bytes copied.
+*/
+static size_t ring_read(object_state *the_object, int priority, struct iov_iter *to, size_t len){
+
+   struct multi_flow_ring *ring = the_object->ring[priority];
+   size_t copied;
+
+   if(len == 0){
+      return 0;
+   }
+
+   copied = ring_load(the_object,priority,ring->head,to,NULL,len);
+   smp_store_release(&(ring->head), ring->head + (u32)copied);
+
+   return copied;
+}
+
+/*
+   Record mode: a write is stored as one message, its header, payload and padding (see MultiDataFlow.h)
+   are published together with the tail, so a reader never sees part of a message.
+   record_size is the space taken in the flow by a write of len bytes and
+   record_fit the longest write that fits in free bytes, for the stream too.
+*/
+#define record_size(record, len) ((record) ? (size_t)MULTI_FLOW_RECORD_SIZE(len) : (size_t)(len))
+
+static size_t record_fit(int record, int free){
+
+   if(!record){
+      return free;
+   }
+   if(free < MULTI_FLOW_RECORD_HEADER){
+      return 0;
+   }
+   return (free - MULTI_FLOW_RECORD_HEADER) & ~(MULTI_FLOW_RECORD_HEADER - 1);
+}
+
+/*
+   Free bytes a blocking write of len bytes waits for: a whole message in record mode, while a stream write
+   goes on as soon as half of the buffer is free, so the reader and the writer of a long write
+   work on the two halves of the buffer at the same time.
+*/
+static size_t flow_write_need(object_state *the_object, int priority, int record, size_t len){
+
+   if(record){
+      return record_size(record,len);
+   }
+   return min_t(size_t, len, max_t(size_t, the_object->capacity[priority] / 2, 1));
+}
+
+/*
+   Append a message of len bytes to the flow, from the user segments or from data if from is NULL.
+   The caller must hold the writers lock of the flow and check the free space for record_size(len).
+   If the copy from the user stops early the bytes copied make the message.
+   Return the bytes of payload written, -EFAULT if none could be copied.
+*/
+static ssize_t record_write(object_state *the_object, int priority, struct iov_iter *from, const void *data, size_t len){
+
+   static const u32 padding = 0;
+   struct multi_flow_ring *ring = the_object->ring[priority];
+   u32 tail = ring->tail;
+   u32 header;
+   size_t copied;
+
+   copied = ring_store(the_object,priority,tail + MULTI_FLOW_RECORD_HEADER,from,data,len);
+   if(copied == 0 && len != 0){
+      return -EFAULT;
+   }
+
+   header = copied;
+   ring_store(the_object,priority,tail,NULL,&header,MULTI_FLOW_RECORD_HEADER);
+   ring_store(the_object,priority,tail + MULTI_FLOW_RECORD_HEADER + copied,NULL,&padding,MULTI_FLOW_RECORD_SIZE(copied) - MULTI_FLOW_RECORD_HEADER - copied);
+
+   smp_store_release(&(ring->tail), tail + MULTI_FLOW_RECORD_SIZE(copied));
+
+   return copied;
+}
+
+/*
+   Copy the messages of the valid bytes from the byte index that fit whole in len bytes, in the layout they are stored,
+   and move index after them.
+   If the first message does not fit, in truncate mode its header and the first bytes of the payload
+   that fit are returned and the rest is dropped, in reject mode it stays in the flow and the read fails with -EMSGSIZE.
+   Return the bytes copied, -EFAULT if the copy of the first message fails.
+*/
+static ssize_t record_copy(object_state *the_object, int priority, struct iov_iter *to, size_t len, u32 *index, int valid){
+
+   u32 head = *index;
+   u32 header, truncated;
+   size_t size, done;
+   ssize_t copied = 0;
+
+   // The messages are published whole, the valid bytes always end with one
+   while(valid > 0){
+      ring_load(the_object,priority,head,NULL,&header,MULTI_FLOW_RECORD_HEADER);
+      size = MULTI_FLOW_RECORD_SIZE(header);
+
+      if(copied + size > len){
+         // The next messages stay for the next read
+         if(copied != 0){
+            break;
+         }
+         if(the_object->record == 2 || len < MULTI_FLOW_RECORD_HEADER){
+            return -EMSGSIZE;
+         }
+
+         // Return the part that fits, with its length
+         truncated = min_t(size_t, header, len - MULTI_FLOW_RECORD_HEADER);
+         done = copy_to_iter(&truncated, MULTI_FLOW_RECORD_HEADER, to);
+         if(done == MULTI_FLOW_RECORD_HEADER){
+            done += ring_load(the_object,priority,head + MULTI_FLOW_RECORD_HEADER,to,NULL,truncated);
+         }
+         if(done != MULTI_FLOW_RECORD_HEADER + truncated){
+            return -EFAULT;
+         }
+         copied = done;
+         head += size;
+         break;
+      }
+
+      done = ring_load(the_object,priority,head,to,NULL,size);
+      if(done != size){
+         // The message stays in the flow, the ones before it are consumed
+         if(copied == 0){
+            return -EFAULT;
+         }
+         break;
+      }
+      copied += size;
+      head += size;
+      valid -= size;
+   }
+
+   *index = head;
+
+   return copied;
+}
+
+/*
+   Read the messages at the head of the flow, see record_copy.
+   The caller must hold the readers lock of the flow.
+*/
+static ssize_t record_read(object_state *the_object, int priority, struct iov_iter *to, size_t len){
+
+   struct multi_flow_ring *ring = the_object->ring[priority];
+   int valid = ring_valid(the_object,priority);
+   u32 head;
+   ssize_t copied;
+
+   if(valid == 0){
+      return 0;
+   }
+
+   head = ring->head;
+   copied = record_copy(the_object,priority,to,len,&head,valid);
+   if(copied > 0){
+      smp_store_release(&(ring->head), head);
+   }
+
+   return copied;
+}
+
+/*
+   Overwrite mode: a write that does not find room moves the head of the flow past the oldest data,
+   whole messages in record mode, so the writers never wait for the readers nor truncate the data.
+   Evict until need bytes are free, the caller must hold the writers lock of the flow and need must fit in the buffer.
+   The head belongs to the readers, so their lock is taken for the eviction.
+   Return -EAGAIN with nowait if the readers lock is busy.
+*/
+static int flow_evict(object_state *the_object, int priority, size_t need, int record, int nowait){
+
+   struct multi_flow_ring *ring = the_object->ring[priority];
+   int capacity = the_object->capacity[priority];
+   int valid;
+   long evicted = 0;
+   u32 head, header;
+
+   if(nowait){
+      if(!mutex_trylock(&(the_object->read_synchronizer[priority]))){
+         return -EAGAIN;
+      }
+   }else{
+      mutex_lock(&(the_object->read_synchronizer[priority]));
+   }
+
+   head = ring->head;
+   valid = ring_valid(the_object,priority);
+   if(record){
+      while(valid > 0 && capacity - valid < need){
+         ring_load(the_object,priority,head,NULL,&header,MULTI_FLOW_RECORD_HEADER);
+         head += MULTI_FLOW_RECORD_SIZE(header);
+         valid -= MULTI_FLOW_RECORD_SIZE(header);
+         evicted++;
+      }
+   }else if(capacity - valid < need){
+      evicted = min_t(long, valid, need - (capacity - valid));
+      head += evicted;
+   }
+   if(evicted != 0){
+      smp_store_release(&(ring->head), head);
+   }
+
+   mutex_unlock(&(the_object->read_synchronizer[priority]));
+
+   if(evicted != 0){
+      flow_overwritten(the_object,priority,evicted);
+      flow_log(the_object,"%s: evicted %ld %s from flow with priority %d of dev with minor %d\n",MODNAME,evicted,record ? "messages" : "bytes",priority,the_object->minor);
+   }
+
+   return 0;
+}
+
+/*
+   Broadcast mode: every session that can read has its own cursor on the two flows and reads all the data
+   written after it subscribed, the head of a flow is the cursor of the slowest subscriber.
+   When a writer does not find room, the subscribers lagging behind the tail more than the limit of the dev
+   are dropped: the data they did not read is retired, and their next read fails with -EPIPE
+   and starts again from the tail.
+   Move the head of the flow to the slowest subscriber, with drop after dropping the ones over the limit.
+   The caller must hold broadcast_lock.
+*/
+static void broadcast_retire(object_state *the_object, int priority, int drop){
+
+   struct multi_flow_ring *ring = the_object->ring[priority];
+   flow_session *session;
+   u32 tail, head, cursor;
+
+   // The head belongs to the readers outside broadcast mode
+   if(!the_object->broadcast || ring == NULL){
+      return;
+   }
+
+   tail = smp_load_acquire(&(ring->tail));
+   head = tail;
+   list_for_each_entry(session,&(the_object->subscribers),link){
+      if(session->dropped){
+         continue;
+      }
+      cursor = READ_ONCE(session->cursor[priority]);
+      if(drop && tail - cursor > the_object->broadcast){
+         session->dropped = 1;
+         flow_stat_inc(the_object,dropped_readers,priority);
+         flow_log(the_object,"%s: dropped a reader lagging %u bytes behind on flow with priority %d of dev with minor %d\n",MODNAME,tail - cursor,priority,the_object->minor);
+         continue;
+      }
+      if(tail - cursor > tail - head){
+         head = cursor;
+      }
+   }
+
+   // The cursors are never behind the head, so it only moves forward
+   smp_store_release(&(ring->head), head);
+}
+
+// Retire the data of the subscribers over the lag limit, for a writer that did not find room
+static void broadcast_make_room(object_state *the_object, int priority){
+
+   spin_lock(&(the_object->broadcast_lock));
+   broadcast_retire(the_object,priority,1);
+   spin_unlock(&(the_object->broadcast_lock));
+}
+
+// Start the cursors of the session from the tail of the flows, it reads only the data written from now on
+static void broadcast_subscribe(object_state *the_object, flow_session *session){
+
+   struct multi_flow_ring *ring;
+   int i;
+
+   for(i=0;i<2;i++){
+      ring = the_object->ring[i];
+      WRITE_ONCE(session->cursor[i], ring == NULL ? 0 : smp_load_acquire(&(ring->tail)));
+   }
+   session->dropped = 0;
+}
+
+/*
+   Read of a subscriber from its cursor, in record mode whole messages.
+   The caller must hold the readers lock of the flow.
+   Return the bytes copied, -EPIPE if the session has been dropped, it starts again from the tail.
+*/
+static ssize_t broadcast_read(object_state *the_object, int priority, flow_session *session, struct iov_iter *to, size_t len, int record){
+
+   u32 cursor = READ_ONCE(session->cursor[priority]);
+   int valid = session_valid(the_object,priority,session);
+   ssize_t copied = 0;
+
+   if(valid != 0 && !READ_ONCE(session->dropped)){
+      if(record){
+         copied = record_copy(the_object,priority,to,len,&cursor,valid);
+      }else{
+         copied = ring_load(the_object,priority,cursor,to,NULL,min_t(size_t, len, valid));
+         cursor += copied;
+      }
+   }
+
+   // A session dropped during the copy could have read overwritten data
+   spin_lock(&(the_object->broadcast_lock));
+   if(session->dropped){
+      broadcast_subscribe(the_object,session);
+      spin_unlock(&(the_object->broadcast_lock));
+      return -EPIPE;
+   }
+   if(copied > 0){
+      WRITE_ONCE(session->cursor[priority], cursor);
+      broadcast_retire(the_object,priority,0);
+   }
+   spin_unlock(&(the_object->broadcast_lock));
+
+   return copied;
+}
+
+/*
+   Replace the ring buffers of both flows with new ones of the given size, either both or none.
+   The valid bytes keep their indices, so they are copied at the offsets they
+   have in the new buffer. The resize fails with -EBUSY if they do not fit in it
+   if a flow is mapped or in spsc or sharded mode. A flow without buffer only records the new size.
+*/
+static int ring_resize(object_state *the_object, int capacity){
+
+   struct multi_flow_ring *ring;
+   char *new_content[2] = {NULL, NULL};
+   char *old_content[2] = {NULL, NULL};
+   int old_capacity;
+   int valid, done, chunk;
+   int priority;
+   int ret = 0;
+   u32 index;
+
+   flow_lock(the_object,0);
+   flow_lock(the_object,1);
+
+   // Check and allocate for both flows before replacing any of them
+   for(priority=0;priority<2;priority++){
+      // The lockless operations of the spsc mode use the buffer without the locks, the sharded mode reads it before the shards
+      if(atomic_read(&(the_object->mapped[priority])) != 0 || ring_valid(the_object,priority) > capacity || the_object->spsc || (priority == 0 && the_object->shards != NULL)){
+         ret = -EBUSY;
+         goto out;
+      }
+      // Buffer not allocated yet, it will be allocated with the new size
+      if(the_object->stream_content[priority] != NULL){
+         new_content[priority] = vmalloc_user(capacity);
+         if(new_content[priority] == NULL){
+            ret = -ENOMEM;
+            goto out;
+         }
+      }
+   }
+
+   for(priority=0;priority<2;priority++){
+      ring = the_object->ring[priority];
+      old_content[priority] = the_object->stream_content[priority];
+      old_capacity = the_object->capacity[priority];
+
+      // Copy the valid bytes in chunks that do not wrap in the old nor in the new buffer
+      if(old_content[priority] != NULL){
+         valid = ring_valid(the_object,priority);
+         index = ring->head;
+         for(done=0;done<valid;done+=chunk){
+            chunk = valid - done;
+            chunk = min(chunk, old_capacity - (int)(index & (old_capacity - 1)));
+            chunk = min(chunk, capacity - (int)(index & (capacity - 1)));
+            memcpy(new_content[priority] + (index & (capacity - 1)), old_content[priority] + (index & (old_capacity - 1)), chunk);
+            index += chunk;
+         }
+         the_object->stream_content[priority] = new_content[priority];
+         new_content[priority] = NULL;
+      }
+
+      the_object->capacity[priority] = capacity;
+      if(ring != NULL){
+         ring->capacity = capacity;
+      }
+
+      // Writers waiting for space could fit in the new buffer
+      flow_wake_writers(the_object,priority);
+   }
+
+out:
+   flow_unlock(the_object,1);
+   flow_unlock(the_object,0);
+
+   // The old buffers after a resize, the new ones after a failure
+   for(priority=0;priority<2;priority++){
+      vfree(old_content[priority]);
+      vfree(new_content[priority]);
+   }
+
+   return ret;
+}
+
+/*
+   Sharded mode of the high priority flow: every cpu has its own sub-buffer and a writer appends
+   to the one of the cpu it runs on, so writers on different cpus share no lock nor cacheline.
+   A reader drains the ring buffer of the flow first, then takes the writes of all the shards
+   in the order of their times, so no shard waits for another one to be emptied
+   and the writes of a task moving between cpus are read in the order they were made.
+*/
+static void shards_free(object_state *the_object, flow_shard __percpu *shards){
+
+   int cpu;
+
+   for_each_possible_cpu(cpu){
+      vfree(per_cpu_ptr(shards, cpu)->content);
+   }
+   free_percpu(shards);
+}
+
+static int shards_enable(object_state *the_object){
+
+   flow_shard __percpu *shards;
+   flow_shard *shard;
+   int cpu;
+   int ret = 0;
+
+   percpu_down_write(&(the_object->shard_sem));
+   flow_lock(the_object,0);
+
+   if(the_object->shards != NULL){
+      goto out;
+   }
+
+   // The shards are not visible through the mapping, the spsc writer uses the ring buffer, the shards hold no messages, have no cursors and are not evicted
+   if(the_object->spsc || the_object->record || the_object->broadcast || the_object->overwrite || atomic_read(&(the_object->mapped[0])) != 0){
+      ret = -EBUSY;
+      goto out;
+   }
+
+   shards = alloc_percpu(flow_shard);
+   if(shards == NULL){
+      ret = -ENOMEM;
+      goto out;
+   }
+   for_each_possible_cpu(cpu){
+      shard = per_cpu_ptr(shards, cpu);
+      mutex_init(&(shard->lock));
+      shard->head = 0;
+      shard->tail = 0;
+      shard->read = 0;
+      shard->written = 0;
+      shard->left = 0;
+      shard->scan = 0;
+      shard->content = vmalloc(the_object->capacity[0]);
+      if(shard->content == NULL){
+         printk("%s: shard allocation failure on dev with minor %d\n",MODNAME,the_object->minor);
+         shards_free(the_object,shards);
+         ret = -ENOMEM;
+         goto out;
+      }
+   }
+
+   the_object->shard_capacity = the_object->capacity[0];
+   smp_store_release(&(the_object->shards), shards);
+
+out:
+   flow_unlock(the_object,0);
+   percpu_up_write(&(the_object->shard_sem));
+   return ret;
+}
+
+/* The mode is disabled only when the shards are empty, -EBUSY otherwise */
+static int shards_disable(object_state *the_object){
+
+   flow_shard __percpu *shards;
+   int cpu;
+
+   percpu_down_write(&(the_object->shard_sem));
+   flow_lock(the_object,0);
+
+   shards = the_object->shards;
+   if(shards != NULL){
+      for_each_possible_cpu(cpu){
+         if(shard_valid(the_object, per_cpu_ptr(shards, cpu)) != 0){
+            flow_unlock(the_object,0);
+            percpu_up_write(&(the_object->shard_sem));
+            return -EBUSY;
+         }
+      }
+      WRITE_ONCE(the_object->shards, NULL);
+   }
+
+   flow_unlock(the_object,0);
+   percpu_up_write(&(the_object->shard_sem));
+
+   // flow_valid and flow_free read the shards without locks
+   if(shards != NULL){
+      synchronize_rcu();
+      shards_free(the_object,shards);
+   }
+
+   return 0;
+}
+
+/* Copy len bytes at the byte index of a shard, as ring_store does for the flow */
+static size_t shard_store(object_state *the_object, flow_shard *shard, u32 index, struct iov_iter *from, const void *data, size_t len){
+
+   return wrap_store(shard->content,the_object->shard_capacity,index,from,data,len);
+}
+
+/* Copy len bytes from the byte index of a shard, as ring_load does for the flow */
+static size_t shard_load(object_state *the_object, flow_shard *shard, u32 index, struct iov_iter *to, void *data, size_t len){
+
+   return wrap_load(shard->content,the_object->shard_capacity,index,to,data,len);
+}
+
+/*
+   High priority write in sharded mode, the data goes to the shard of the cpu of the writer.
+   If the mode has been disabled meanwhile it sets sharded to 0 and the write goes to the ring buffer.
+   Return the bytes written or the error.
+*/
+static ssize_t shard_write(object_state *the_object, flow_session *session, struct iov_iter *from, size_t len, int nowait, int *sharded){
+
+   size_t requested = len;
+   flow_shard *shard;
+   u64 header[2];
+   size_t written;
+   size_t streamed = 0;
+   int timed_out;
+   int streaming = 0;
+   ktime_t wait_start = 0;
+   ktime_t deadline = 0;
+
+retry_shard:
+   if(nowait){
+      if(!percpu_down_read_trylock(&(the_object->shard_sem))){
+         return streamed > 0 ? streamed : -EAGAIN;
+      }
+   }else{
+      percpu_down_read(&(the_object->shard_sem));
+   }
+   if(the_object->shards == NULL){
+      percpu_up_read(&(the_object->shard_sem));
+      // The rest of a streaming write is not moved to the flow, behind the data of the shards
+      if(streamed > 0){
+         return streamed;
+      }
+      *sharded = 0;
+      return 0;
+   }
+
+   // The writer can move to another cpu, the lock of the shard keeps the writers of the shard in order
+   shard = raw_cpu_ptr(the_object->shards);
+   if(nowait){
+      if(!mutex_trylock(&(shard->lock))){
+         percpu_up_read(&(the_object->shard_sem));
+         return streamed > 0 ? streamed : -EAGAIN;
+      }
+   }else{
+      mutex_lock(&(shard->lock));
+   }
+
+   if(len > shard_free(the_object,shard)){
+      // As in the flow, a blocking write copies what fits and goes on with the rest
+      if(!session_nonblocking(session) && shard_free(the_object,shard) > 0){
+         len = shard_free(the_object,shard);
+         streaming = 1;
+      }else if(!session_nonblocking(session)){
+         mutex_unlock(&(shard->lock));
+         percpu_up_read(&(the_object->shard_sem));
+         if(nowait){
+            return streamed > 0 ? streamed : -EAGAIN;
+         }
+
+         // Wait for room in the shard of the cpu, the mode can change while sleeping
+         if(trace_multi_flow_wait_enter_enabled()){
+            trace_multi_flow_wait_enter(the_object->minor,0,1,len,flow_valid(the_object,0),session->timeout);
+         }
+         flow_stat_inc(the_object,sleeps,0);
+         if(wait_start == 0){
+            wait_start = ktime_get();
+         }
+         // The timeout is a budget for the whole call, also across the parts of a streaming write
+         if(deadline == 0){
+            deadline = flow_deadline(session->timeout);
+         }
+         timed_out = flow_wait(the_object,0,1,min_t(size_t, len, the_object->shard_capacity / 2),deadline,session);
+         if(trace_multi_flow_wait_exit_enabled()){
+            trace_multi_flow_wait_exit(the_object->minor,0,1,len,flow_valid(the_object,0),timed_out);
+         }
+         if(deadline != 0){
+            session_remaining(session,deadline);
+         }
+         if(timed_out){
+            // The write ends with the bytes written before the timeout
+            flow_stat_inc(the_object,timeouts,0);
+            return streamed > 0 ? streamed : -EAGAIN;
+         }else{
+            flow_stat_inc(the_object,wakeups,0);
+         }
+         goto retry_shard;
+      }else{
+         len = shard_free(the_object,shard);
+      }
+   }
+
+   if(wait_start != 0){
+      flow_latency_record(the_object->latency->wt_wait[0],wait_start);
+      wait_start = 0;
+   }
+
+   // Copy the data after the header at the tail of the shard, the header tells the bytes copied
+   written = len > 0 ? shard_store(the_object,shard,shard->tail + SHARD_HEADER,from,NULL,len) : 0;
+   if(written > 0){
+      // The time orders the writes of all the shards without a counter shared by the cpus, the ones of a writer follow each other
+      header[0] = written;
+      header[1] = ktime_get_ns();
+      shard_store(the_object,shard,shard->tail,NULL,header,SHARD_HEADER);
+
+      // The reader finds the write through the tail once it counts its data
+      smp_store_release(&(shard->tail), shard->tail + SHARD_HEADER + (u32)written);
+      smp_store_release(&(shard->written), shard->written + (u32)written);
+   }
+
+   if(trace_multi_flow_write_enabled()){
+      trace_multi_flow_write(the_object->minor,0,written,shard_data(the_object,shard));
+   }
+
+   mutex_unlock(&(shard->lock));
+   percpu_up_read(&(the_object->shard_sem));
+
+   flow_stat_add(the_object,bytes_written,0,written);
+   streamed += written;
+
+   flow_wake_readers(the_object,0);
+
+   // The rest of a streaming write waits for the room the reader frees, the cpu can be another one.
+   // Every part takes a later time, so the parts are read in order, with other writes possibly between them
+   if(streaming && written == len && iov_iter_count(from) > 0){
+      len = iov_iter_count(from);
+      streaming = 0;
+      goto retry_shard;
+   }
+
+   flow_stat_inc(the_object,writes,0);
+   if(streamed < requested){
+      flow_stat_inc(the_object,short_writes,0);
+   }
+
+   if(streamed == 0 && len != 0){
+      return -EFAULT;
+   }
+   return streamed;
+}
+
+/*
+   Shard with the oldest write not yet read, NULL if the shards are empty.
+   The header of the write at the head of a shard is taken when it is first seen, it stays
+   the current write of the shard until its data is read. The caller holds the readers lock.
+   A write published on a shard already scanned is missed by the scan, while a later write of the same task
+   on a shard scanned after it is not: the oldest write is taken only if its header was taken by an earlier scan,
+   then all the writes made before it were published before the last scan started and were seen by it.
+*/
+static flow_shard *shard_next(object_state *the_object){
+
+   flow_shard *shard, *next;
+   u64 header[2];
+   u32 scan;
+   int cpu;
+
+   // A shard takes a header at most once per call, so the scans end at the latest when all the shards have one
+   do{
+      scan = ++the_object->shard_scan;
+      next = NULL;
+      for_each_possible_cpu(cpu){
+         shard = per_cpu_ptr(the_object->shards, cpu);
+         if(shard->left == 0 && shard->head != smp_load_acquire(&(shard->tail))){
+            shard_load(the_object,shard,shard->head,NULL,header,SHARD_HEADER);
+            shard->left = header[0];
+            shard->stamp = header[1];
+            shard->scan = scan;
+            smp_store_release(&(shard->head), shard->head + SHARD_HEADER);
+         }
+         // Writes made at the same time go by cpu
+         if(shard->left != 0 && (next == NULL || shard->stamp < next->stamp)){
+            next = shard;
+         }
+      }
+   }while(next != NULL && next->scan == scan);
+
+   return next;
+}
+
+/*
+   Read len bytes of the flow, in sharded mode from the ring buffer and then from the shards.
+   The caller must hold the readers lock of the flow and check the valid bytes.
+   Return the number of bytes copied.
+*/
+static size_t flow_read(object_state *the_object, int priority, struct iov_iter *to, size_t len){
+
+   flow_shard *shard;
+   size_t copied, chunk, done;
+
+   if(priority != 0 || the_object->shards == NULL){
+      return ring_read(the_object,priority,to,len);
+   }
+
+   // Bytes written before the mode was enabled come first
+   copied = ring_read(the_object,0,to,min_t(size_t, len, ring_valid(the_object,0)));
+
+   // Then the writes of the shards from the oldest one, a write read in part is continued first
+   while(copied < len && (shard = shard_next(the_object)) != NULL){
+      chunk = min_t(size_t, len - copied, shard->left);
+      done = shard_load(the_object,shard,shard->head,to,NULL,chunk);
+      shard->left -= done;
+      smp_store_release(&(shard->read), shard->read + (u32)done);
+      smp_store_release(&(shard->head), shard->head + (u32)done);
+      copied += done;
+      if(done != chunk){
+         break;
+      }
+   }
+
+   return copied;
+}
+
+/* Track the mappings of a flow, vm_private_data is the counter of the flow */
+static void flow_vm_open(struct vm_area_struct *vma){
+
+   atomic_inc((atomic_t*)vma->vm_private_data);
+}
+
+static void flow_vm_close(struct vm_area_struct *vma){
+
+   atomic_dec((atomic_t*)vma->vm_private_data);
+}
+
+static const struct vm_operations_struct flow_vm_ops = {
+  .open = flow_vm_open,
+  .close = flow_vm_close
+};
+
+
+/* Open operation of the driver */
+static int dev_open(struct inode *inode, struct file *file) {
+
+   int minor;
+   flow_session *session;
+   minor = get_minor(file);
+
+   // Check if minor number is supported
+   if(minor >= MINORS){
+	  return -ENODEV;
+   }
+
+   // Check if permissions to open the session are enabled
+   if(open_permissions[minor] == 1){
+      return -ENODEV;
+   }
+
+   session = kzalloc(sizeof(flow_session),GFP_KERNEL);
+   if(session == NULL){
+      return -ENOMEM;
+   }
+   INIT_LIST_HEAD(&(session->link));
+   file->private_data = session;
+
+   // The settings of the session start from the ones of the minor
+   session->file = file;
+   session->prio = READ_ONCE(objects[minor].prio);
+   session->blocking = READ_ONCE(objects[minor].blocking);
+   session->timeout = READ_ONCE(objects[minor].timeout);
+   session->remaining = session->timeout;
+
+   // A session that can read is a subscriber of the broadcast mode, from the data written after it opened
+   if(file->f_mode & FMODE_READ){
+      spin_lock(&(objects[minor].broadcast_lock));
+      broadcast_subscribe(&objects[minor],session);
+      list_add_tail(&(session->link),&(objects[minor].subscribers));
+      spin_unlock(&(objects[minor].broadcast_lock));
+   }
+
+   // The buffers are not reclaimed while a session is open
+   atomic_inc(&(objects[minor].sessions));
+
+   // A second writer or reader ends the lockless path of its side, the running lockless operations finish first
+   if(file->f_mode & FMODE_WRITE){
+      atomic_inc(&(objects[minor].writers));
+   }
+   if(file->f_mode & FMODE_READ){
+      atomic_inc(&(objects[minor].readers));
+   }
+   spsc_drain(&objects[minor]);
+
+#ifdef FMODE_NOWAIT
+   // read_iter and write_iter honor IOCB_NOWAIT
+   file->f_mode |= FMODE_NOWAIT;
+#endif
+
+   flow_log(&objects[minor],"%s: device file successfully opened for object with minor %d\n",MODNAME,minor);
+
+   return 0;
+}
+
+/* Release operation of the driver */
+static int dev_release(struct inode *inode, struct file *file) {
+
+   int minor;
+   flow_session *session = file->private_data;
+   minor = get_minor(file);
+
+   flow_log(&objects[minor],"%s: device file wit minor %d closed\n",MODNAME,minor);
+
+   // The data held only for this subscriber is retired
+   if(file->f_mode & FMODE_READ){
+      spin_lock(&(objects[minor].broadcast_lock));
+      list_del(&(session->link));
+      broadcast_retire(&objects[minor],0,0);
+      broadcast_retire(&objects[minor],1,0);
+      spin_unlock(&(objects[minor].broadcast_lock));
+      if(READ_ONCE(objects[minor].broadcast)){
+         flow_wake_writers(&objects[minor],0);
+         flow_wake_writers(&objects[minor],1);
+      }
+   }
+   kfree(session);
+
+   // Start the idle time before the buffers can be reclaimed
+   objects[minor].last_release = jiffies;
+   if(file->f_mode & FMODE_WRITE){
+      atomic_dec(&(objects[minor].writers));
+   }
+   if(file->f_mode & FMODE_READ){
+      atomic_dec(&(objects[minor].readers));
+   }
+   atomic_dec(&(objects[minor].sessions));
+
+   return 0;
+
+}
+
+
+/*
+   Write of a session on a minor, the data is taken from all the segments of the iov_iter.
+   With nowait it fails with -EAGAIN instead of sleeping.
+*/
+static ssize_t session_write(object_state *the_object, flow_session *session, struct iov_iter *from, int nowait) {
+
+  int minor = the_object->minor;
+  size_t len = iov_iter_count(from);
+  size_t requested = len;
+  size_t skipped = 0;
+  size_t written;
+  size_t streamed = 0;
+  int ret = 0;
+  int timed_out;
+  ktime_t wait_start = 0;
+  ktime_t deadline = 0;
+  int spsc = 0;
+  int record = 0;
+  int streaming = 0;
+  int priority;
+
+  // Check if there is nothing to write
+  if(len == 0){
+   return 0;
+  }
+
+  // The whole timeout is left until the write sleeps
+  if(READ_ONCE(session->timeout) > 0){
+      WRITE_ONCE(session->remaining, READ_ONCE(session->timeout));
+  }
+
+  // Check the priority of the session
+  priority = READ_ONCE(session->prio);
+
+  if(priority == 1){
+      flow_log(the_object,"%s: somebody called a low priority write on dev with [major,minor] number [%d,%d] starting from offest %d with priority %d\n",MODNAME,Major,minor,flow_valid(the_object,1),priority);
+
+      // Get the buffer now, the deferred write does not allocate
+      if(nowait){
+         if(!mutex_trylock(&(the_object->write_synchronizer[priority]))){
+            return -EAGAIN;
+         }
+      }else{
+         mutex_lock(&(the_object->write_synchronizer[priority]));
+      }
+      ret = ring_alloc(the_object,priority,nowait);
+      mutex_unlock(&(the_object->write_synchronizer[priority]));
+      if(ret != 0){
+         return ret;
+      }
+
+      // A write larger than the buffer could never be appended whole
+      record = READ_ONCE(the_object->record);
+      if(record_size(record,len) > the_object->capacity[priority]){
+         if(record == 2){
+            return -EMSGSIZE;
+         }
+         // In overwrite mode the stream keeps the newest bytes of the write
+         if(!record && READ_ONCE(the_object->overwrite)){
+            skipped = len - the_object->capacity[priority];
+            iov_iter_advance(from,skipped);
+            flow_overwritten(the_object,priority,skipped);
+         }
+         len = record_fit(record,the_object->capacity[priority]);
+      }
+
+      // Return the bytes copied for the deferred write
+      ret = put_work(the_object,session,from,len,nowait);
+      if(ret >= 0 && ret < requested - skipped){
+         flow_stat_inc(the_object,short_writes,priority);
+      }
+      return ret >= 0 ? ret + skipped : ret;
+  }
+
+write_sharded:
+  // Sharded dev: the write goes to the shard of the cpu, without the writers lock of the flow
+  if(priority == 0 && READ_ONCE(the_object->shards) != NULL){
+      int sharded = 1;
+      ret = shard_write(the_object,session,from,len,nowait,&sharded);
+      if(sharded){
+         return ret;
+      }
+  }
+
+  // Only writer of a spsc dev: without lock, if the write does not have to wait
+  if(priority == 0 && spsc_enter(the_object,0,priority)){
+      if(the_object->stream_content[priority] != NULL && (len <= flow_free(the_object,priority) || session_nonblocking(session))){
+         len = min_t(size_t, len, flow_free(the_object,priority));
+         spsc = 1;
+         goto write_high;
+      }
+      spsc_exit(the_object,0);
+  }
+
+retry_write_high:
+
+  // Get the lock for opertion on the device
+  if(nowait){
+      if(!mutex_trylock(&(the_object->write_synchronizer[priority]))){
+         if(streamed > 0){
+            goto write_done;
+         }
+         return -EAGAIN;
+      }
+  }else{
+      mutex_lock(&(the_object->write_synchronizer[priority])); 
+  }
+
+  // The lockless write of another thread of the session finishes first
+  spsc_exclude(the_object,0);
+
+  // A streaming write ends with the bytes already written if the mode of the dev changed between two parts
+  if(streamed > 0 && (the_object->shards != NULL || the_object->record || the_object->overwrite)){
+      mutex_unlock(&(the_object->write_synchronizer[priority]));
+      goto write_done;
+  }
+
+  // The sharded mode was enabled while waiting for the lock
+  if(the_object->shards != NULL){
+      mutex_unlock(&(the_object->write_synchronizer[priority]));
+      goto write_sharded;
+  }
+  flow_log(the_object,"%s: called high priority write on dev with minor %d, starting from offest %d with priority %d\n",MODNAME,minor,flow_valid(the_object,priority),priority);
+
+  // Allocate the buffer on the first write
+  ret = ring_alloc(the_object,priority,nowait);
+  if(ret != 0){
+      mutex_unlock(&(the_object->write_synchronizer[priority]));
+      return ret;
+  }
+
+  // The mode does not change under the lock of the flow, a message larger than the buffer could never be stored whole
+  record = the_object->record;
+  if(record && record_size(record,len) > the_object->capacity[priority]){
+      if(record == 2){
+         mutex_unlock(&(the_object->write_synchronizer[priority]));
+         return -EMSGSIZE;
+      }
+      len = record_fit(record,the_object->capacity[priority]);
+  }
+
+  // In broadcast mode the room is held by the slowest subscribers, the ones over the lag limit are dropped
+  if(the_object->broadcast && record_size(record,len) > flow_free(the_object,priority)){
+      broadcast_make_room(the_object,priority);
+  }
+
+  // In overwrite mode the oldest data makes room, the stream keeps the newest bytes of a write larger than the buffer
+  if(the_object->overwrite && record_size(record,len) > flow_free(the_object,priority)){
+      ret = flow_evict(the_object,priority,min_t(size_t, record_size(record,len), the_object->capacity[priority]),record,nowait);
+      if(ret != 0){
+         mutex_unlock(&(the_object->write_synchronizer[priority]));
+         return ret;
+      }
+      if(!record && len > the_object->capacity[priority]){
+         skipped = len - the_object->capacity[priority];
+         iov_iter_advance(from,skipped);
+         flow_overwritten(the_object,priority,skipped);
+         len = the_object->capacity[priority];
+      }
+  }
+
+  // Check if the write reaches memory bound,then resize the write or go on wait_queue
+  if(record_size(record,len) > flow_free(the_object,priority)){
+
+      // Case session is blocking, a stream write copies what fits and goes on with the rest
+      if(!session_nonblocking(session) && !record && flow_free(the_object,priority) > 0){
+         len = flow_free(the_object,priority);
+         streaming = 1;
+      }else if(!session_nonblocking(session)){
+         // Release the lock for operations
+         mutex_unlock(&(the_object->write_synchronizer[priority]));
+         flow_log(the_object,"%s : Insufficient space on high priority buffer to write on dev with [major,minor] number [%d,%d]\n",MODNAME,Major,minor);
+
+         // The caller does not want to sleep
+         if(nowait){
+            if(streamed > 0){
+               goto write_done;
+            }
+            return -EAGAIN;
+         }
+
+         if(trace_multi_flow_wait_enter_enabled()){
+            trace_multi_flow_wait_enter(minor,priority,1,len,flow_valid(the_object,priority),session->timeout);
+         }
+         flow_stat_inc(the_object,sleeps,priority);
+         if(wait_start == 0){
+            wait_start = ktime_get();
+         }
+         // The timeout is a budget for the whole call, also across the parts of a streaming write
+         if(deadline == 0){
+            deadline = flow_deadline(session->timeout);
+         }
+
+         // Going sleep in the write queue, until the deadline of the write if the timeout is set
+         flow_log(the_object,"%s : go to sleep for high priority write on dev %d with timeout %llu ns\n",MODNAME,minor,session->timeout);
+         timed_out = flow_wait(the_object,priority,1,flow_write_need(the_object,priority,record,len),deadline,session);
+
+         if(trace_multi_flow_wait_exit_enabled()){
+            trace_multi_flow_wait_exit(minor,priority,1,len,flow_valid(the_object,priority),timed_out);
+         }
+         if(deadline != 0){
+            session_remaining(session,deadline);
+         }
+         if(timed_out){
+            flow_stat_inc(the_object,timeouts,priority);
+            // The timeout ends a streaming write with the bytes already written
+            if(streamed > 0){
+               goto write_done;
+            }
+            return -EAGAIN;
+         }else{
+            flow_stat_inc(the_object,wakeups,priority);
+         }
+
+         // retry write when wake up from wait queue
+         goto retry_write_high;
+      }
+      else{ // Case session is non-blocking
+         // Set the len of bytes to write to max remaining bytes, a message is truncated or rejected
+         len = record == 2 ? 0 : record_fit(record,flow_free(the_object,priority));
+         if(record && len == 0){
+            mutex_unlock(&(the_object->write_synchronizer[priority]));
+            return -EAGAIN;
+         }
+      }
+
+  }
+
+  // Time spent in the write queue since the first sleep, of this part for a streaming write
+  if(wait_start != 0){
+      flow_latency_record(the_object->latency->wt_wait[priority],wait_start);
+      wait_start = 0;
+  }
+
+write_high:
+
+  // Copy data from the user segments to the tail of the kernel ring buffer, the bytes copied become valid
+  if(record){
+      ret = record_write(the_object,priority,from,NULL,len);
+      written = ret < 0 ? 0 : ret;
+  }else{
+      written = ring_write(the_object,priority,from,len);
+  }
+  if(written != len){
+      flow_log(the_object,"%s : Error in high priority write, could only write %zu bytes of %zu",MODNAME,written,len);
+  }
+
+  // Update module parameter array of valid bytes
+  bytes_high[minor] = flow_valid(the_object,priority);
+
+  trace_multi_flow_write(minor,priority,written,bytes_high[minor]);
+  flow_stat_add(the_object,bytes_written,priority,written);
+  streamed += written;
+
+  // Wake up the processes waiting in read queue with high priority that the new data can satisfy
+  flow_wake_readers(the_object,priority);
+
+  flow_log(the_object,"%s: Done high priority write. Valid bytes are now %d on dev with [major,minor] number [%d,%d]\n",MODNAME,flow_valid(the_object,priority),Major,minor);
+
+  // Release the lock fo operations on the device
+  if(spsc){
+      spsc_exit(the_object,0);
+      spsc = 0;
+  }else{
+      mutex_unlock(&(the_object->write_synchronizer[priority]));
+  }
+
+  // The part written is readable, the rest of a streaming write waits for the room the readers free
+  if(streaming && written == len && iov_iter_count(from) > 0){
+      len = iov_iter_count(from);
+      streaming = 0;
+      goto retry_write_high;
+  }
+
+write_done:
+  flow_stat_inc(the_object,writes,priority);
+  if(streamed + skipped < requested){
+      flow_stat_inc(the_object,short_writes,priority);
+  }
+
+  // Return the written bytes, with the ones overwritten in place of the oldest
+  if(streamed == 0 && len != 0){
+      return -EFAULT;
+  }
+  return streamed + skipped;
+
+}
+
+// Write operation of the driver, IOCB_NOWAIT asks for a write that does not sleep
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+
+  struct file *filp = iocb->ki_filp;
+
+  return session_write(objects + get_minor(filp),filp->private_data,from,iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+   Read of a session on a minor, the data is stored in all the segments of the iov_iter.
+   With nowait it fails with -EAGAIN instead of sleeping.
+*/
+static ssize_t session_read(object_state *the_object, flow_session *session, struct iov_iter *to, int nowait) {
+
+  int minor = the_object->minor;
+  size_t len = iov_iter_count(to);
+  size_t requested = len;
+  size_t read;
+  size_t need;
+  ssize_t ret = 0;
+  int timed_out;
+  int expired = 0;
+  ktime_t wait_start = 0;
+  ktime_t deadline = 0;
+  int spsc = 0;
+  int record = 0;
+  int broadcast = 0;
+  int priority;
+
+  // Check the priority of the session
+  priority = READ_ONCE(session->prio);
+
+  // The whole timeout is left until the read sleeps
+  if(READ_ONCE(session->timeout) > 0){
+      WRITE_ONCE(session->remaining, READ_ONCE(session->timeout));
+  }
+
+  // Only reader of a spsc dev: without lock, if the read does not have to wait
+  if(spsc_enter(the_object,1,priority)){
+      if(session_need(session,len) <= flow_valid(the_object,priority) || session_nonblocking(session)){
+         len = min_t(size_t, len, flow_valid(the_object,priority));
+         spsc = 1;
+         goto read_flow;
+      }
+      spsc_exit(the_object,1);
+  }
+
+retry_read:
+  // Get the lock for opertion on the device
+  if(nowait){
+      if(!mutex_trylock(&(the_object->read_synchronizer[priority]))){
+         return -EAGAIN;
+      }
+  }else{
+      mutex_lock(&(the_object->read_synchronizer[priority])); 
+  }
+
+  // The lockless read of another thread of the session finishes first
+  spsc_exclude(the_object,1);
+  flow_log(the_object,"%s: somebody called a read of %zu bytes on flow with priority %d, on dev with [major,minor] number [%d,%d]\n",MODNAME,len,priority,Major,minor);
+
+  // The modes do not change under the lock of the flow, a message is published whole so any valid byte is part of one
+  record = the_object->record;
+  broadcast = the_object->broadcast;
+  need = record ? 1 : session_need(session,len);
+
+  // A batch reader has no cursor of its own, see flow_batch
+  if(broadcast && list_empty(&(session->link))){
+      mutex_unlock(&(the_object->read_synchronizer[priority]));
+      return -EOPNOTSUPP;
+  }
+
+  /*
+      Resize the reading len if major then then the valid bytes,
+      or go to sleep in read waiting queues.
+      In broadcast mode the valid bytes are the ones after the cursor of the session.
+  */
+  if(need > session_valid(the_object,priority,session)){
+
+      // Case session is blocking, until the timeout expires
+      if(!session_nonblocking(session) && !expired){
+         // Release the lock for operations
+         mutex_unlock(&(the_object->read_synchronizer[priority]));
+         flow_log(the_object,"%s : Insufficient number of bytes to read on flow with priority %d, on dev with [major,minor] number [%d,%d]\n",MODNAME,priority,Major,minor);
+
+         // The caller does not want to sleep
+         if(nowait){
+            return -EAGAIN;
+         }
+
+         // Increase counter in the module parameter array of thread waiting for data 
+         flow_waiting(the_object,priority,1);
+
+         if(trace_multi_flow_wait_enter_enabled()){
+            trace_multi_flow_wait_enter(minor,priority,0,len,flow_valid(the_object,priority),session->timeout);
+         }
+         flow_stat_inc(the_object,sleeps,priority);
+         if(wait_start == 0){
+            wait_start = ktime_get();
+         }
+         // The timeout is a budget for the whole call, also across the retries
+         if(deadline == 0){
+            deadline = flow_deadline(session->timeout);
+         }
+
+         // Going sleep in the read queue, until the deadline of the read if the timeout is set
+         flow_log(the_object,"%s : go to sleep for read with priority %d on dev %d with timeout %llu ns\n",MODNAME,priority,minor,session->timeout);
+         timed_out = flow_wait(the_object,priority,0,need,deadline,session);
+
+         if(trace_multi_flow_wait_exit_enabled()){
+            trace_multi_flow_wait_exit(minor,priority,0,len,flow_valid(the_object,priority),timed_out);
+         }
+         if(deadline != 0){
+            session_remaining(session,deadline);
+         }
+         if(timed_out){
+            flow_stat_inc(the_object,timeouts,priority);
+            expired = 1;
+         }else{
+            flow_stat_inc(the_object,wakeups,priority);
+         }
+
+         // Decrease counter in the module parameter array of thread waiting for data 
+         flow_waiting(the_object,priority,-1);
+         goto retry_read;
+      }else if (expired && session_valid(the_object,priority,session) == 0){
+         // Nothing arrived before the timeout
+         mutex_unlock(&(the_object->read_synchronizer[priority]));
+         return -EAGAIN;
+      }else if (!record){ // Case session is non-blocking, or the timeout expired
+         // Set the len of bytes to read to max readable bytes
+         len = session_valid(the_object,priority,session);
+      }   
+  }else if (!record && len > need){
+      // Low watermark reached, return what is valid up to len
+      len = min_t(size_t, len, session_valid(the_object,priority,session));
+  }
+
+  // Time spent in the read queue since the first sleep
+  if(wait_start != 0){
+      flow_latency_record(the_object->latency->rd_wait[priority],wait_start);
+  }
+
+read_flow:
+
+  // Copy data from the head of the kernel ring buffer, and of the shards, to the user segments, the read bytes are consumed
+  if(broadcast){
+      ret = broadcast_read(the_object,priority,session,to,len,record);
+      read = ret < 0 ? 0 : ret;
+  }else if(record){
+      ret = record_read(the_object,priority,to,len);
+      read = ret < 0 ? 0 : ret;
+  }else{
+      read = flow_read(the_object,priority,to,len);
+  }
+
+  // Update parameter array of valid bytes
+  if(priority == 0){
+   bytes_high[minor] = flow_valid(the_object,priority);
+  }else if (priority == 1){
+   bytes_low[minor] = flow_valid(the_object,priority);
+  }
+
+  trace_multi_flow_read(minor,priority,read,priority == 0 ? bytes_high[minor] : bytes_low[minor]);
+  flow_stat_inc(the_object,reads,priority);
+  flow_stat_add(the_object,bytes_read,priority,read);
+  if(read < requested){
+      flow_stat_inc(the_object,short_reads,priority);
+  }
+
+  // Wake up the processes waiting in write queue of the appropriate priority that the freed space can satisfy
+  flow_wake_writers(the_object,priority);
+
+  flow_log(the_object,"%s: Done read with priority %d. Valid bytes are now %d on dev with [major,minor] number [%d,%d]\n",MODNAME,priority,flow_valid(the_object,priority),Major,minor);
+  
+  // Release the lock for operations on the device
+  if(spsc){
+      spsc_exit(the_object,1);
+  }else{
+      mutex_unlock(&(the_object->read_synchronizer[priority]));
+  }
+  
+  // Return the read bytes, a message that does not fit or can not be copied is an error
+  if(ret < 0){
+      return ret;
+  }
+  if(read == 0 && len != 0 && !record){
+      return -EFAULT;
+  }
+  return read;
+}
+
+// Read operation of the driver, IOCB_NOWAIT asks for a read that does not sleep
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+  struct file *filp = iocb->ki_filp;
+
+  return session_read(objects + get_minor(filp),filp->private_data,to,iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/* 
+   Poll operation of the driver, it reports the state of the flow of the current priority.
+   The flow is readable if it has valid bytes and writable if it has free space,
+   or for low priority if the deferred queue has room.
+*/
+static __poll_t dev_poll(struct file *filp, poll_table *wait) {
+
+  int minor = get_minor(filp);
+  flow_session *session = filp->private_data;
+  object_state *the_object;
+  int priority;
+  __poll_t mask = 0;
+
+  the_object = objects + minor;
+  priority = READ_ONCE(session->prio);
+
+  // Writes, reads and deferred writes wake up the poll queue of the flow
+  poll_wait(filp, &(the_object->poll_queue[priority]), wait);
+  if(priority == 1){
+      poll_wait(filp, &(the_object->pending_queue), wait);
+  }
+
+  // Pairs with wq_has_sleeper of the wake up: either this check sees the new state or the waker sees the poller
+  smp_mb();
+
+  // As for a blocking read, the low watermark of the session has to be reached
+  if(session_valid(the_object,priority,session) >= max(READ_ONCE(session->lowat), 1)){
+      mask |= EPOLLIN | EPOLLRDNORM;
+  }
+
+  if(priority == 0){
+      if(flow_free(the_object,0) > 0 || READ_ONCE(the_object->overwrite)){
+         mask |= EPOLLOUT | EPOLLWRNORM;
+      }
+  }else if(atomic_read(&(the_object->pending)) < deferred_max_writes && READ_ONCE(the_object->pending_bytes) < deferred_max_bytes){
+      mask |= EPOLLOUT | EPOLLWRNORM;
+  }
+
+  return mask;
+}
+
+/* 
+   mmap operation of the driver, it maps the flow of the current priority:
+   the control block with the indices in the first page, followed by the ring buffer.
+   The mapping can be shorter than the whole flow, e.g. only the control block to read the capacity.
+*/
+static int dev_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+  int minor = get_minor(filp);
+  flow_session *session = filp->private_data;
+  object_state *the_object;
+  int priority;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  unsigned long offset;
+  struct page *page;
+  int ret;
+
+  the_object = objects + minor;
+  priority = READ_ONCE(session->prio);
+
+  // The mapping is shared with the driver and starts from the control block
+  if(!(vma->vm_flags & VM_SHARED) || vma->vm_pgoff != 0){
+      return -EINVAL;
+  }
+
+  mutex_lock(&(the_object->write_synchronizer[priority]));
+
+  // The flow needs its buffer to be mapped, the shards of a sharded flow can not be, the messages are stored only by the driver
+  // and the head is moved only by the subscribers in broadcast mode and by the writers in overwrite mode
+  ret = ((priority == 0 && the_object->shards != NULL) || the_object->record || the_object->broadcast || the_object->overwrite) ? -EBUSY : ring_alloc(the_object,priority,0);
+  if(ret == 0 && size > PAGE_SIZE + the_object->capacity[priority]){
+      ret = -EINVAL;
+  }
+
+  // Insert the page of the control block and the pages of the ring buffer
+  for(offset=0;ret == 0 && offset<size;offset+=PAGE_SIZE){
+      if(offset == 0){
+         page = vmalloc_to_page(the_object->ring[priority]);
+      }else{
+         page = vmalloc_to_page(the_object->stream_content[priority] + offset - PAGE_SIZE);
+      }
+      ret = vm_insert_page(vma, vma->vm_start + offset, page);
+  }
+
+  if(ret == 0){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+      vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+      vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+      // The buffer is not resized nor reclaimed while it is mapped
+      vma->vm_private_data = &(the_object->mapped[priority]);
+      vma->vm_ops = &flow_vm_ops;
+      flow_vm_open(vma);
+      flow_log(the_object,"%s: mapped %lu bytes of flow with priority %d on dev with [major,minor] number [%d,%d]\n",MODNAME,size,priority,get_major(filp),get_minor(filp));
+  }
+
+  mutex_unlock(&(the_object->write_synchronizer[priority]));
+
+  return ret;
+}
+
+/*
+   Batch of reads or writes on many minors with a single ioctl, see struct multi_flow_batch.
+   Every entry names a session opened by the caller, so only the minors the caller could open
+   with the access mode of the batch are reached. The entry is done on the minor of that session
+   by a session that lives only for the operation and is non-blocking, so a flow that is not ready
+   fails alone with -EAGAIN.
+   Return the number of entries that moved data, the result of each one is in the entry.
+*/
+static long flow_batch(struct file *filp, struct multi_flow_batch __user *param){
+
+  struct multi_flow_batch batch;
+  struct multi_flow_batch_entry entry;
+  struct multi_flow_batch_entry __user *entries;
+  flow_session session;
+  struct file *file;
+  struct iov_iter iter;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+  struct iovec iov;
+#endif
+  fmode_t mode;
+  ssize_t ret;
+  long done = 0;
+  u32 i;
+
+  if(copy_from_user(&batch,param,sizeof(batch))){
+      return -EFAULT;
+  }
+  if(batch.count > MULTI_FLOW_BATCH_MAX || batch.write > 1){
+      return -EINVAL;
+  }
+  mode = batch.write ? FMODE_WRITE : FMODE_READ;
+  entries = u64_to_user_ptr(batch.entries);
+
+  for(i=0;i<batch.count;i++){
+      if(copy_from_user(&entry,entries + i,sizeof(entry))){
+         return done > 0 ? done : -EFAULT;
+      }
+      if(entry.flow > 1){
+         ret = -EINVAL;
+         goto put_result;
+      }
+
+      // The fd must be a session of this driver opened for the direction of the batch
+      file = fget(entry.fd);
+      if(file == NULL){
+         ret = -EBADF;
+         goto put_result;
+      }
+      if(file->f_op != &fops || !(file->f_mode & mode)){
+         fput(file);
+         ret = -EBADF;
+         goto put_result;
+      }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+      ret = import_ubuf(batch.write ? ITER_SOURCE : ITER_DEST, u64_to_user_ptr(entry.buf), entry.len, &iter);
+#else
+      ret = import_single_range(batch.write ? WRITE : READ, u64_to_user_ptr(entry.buf), entry.len, &iov, &iter);
+#endif
+      if(ret == 0){
+         // Session on the minor of the fd, counted by the open of the fd. It is not a subscriber of the broadcast mode
+         memset(&session,0,sizeof(session));
+         INIT_LIST_HEAD(&(session.link));
+         session.file = file;
+         session.prio = entry.flow;
+         session.blocking = 1;
+
+         if(batch.write){
+            ret = session_write(objects + get_minor(file),&session,&iter,1);
+         }else{
+            ret = session_read(objects + get_minor(file),&session,&iter,1);
+         }
+      }
+      fput(file);
+
+put_result:
+      if(ret > 0){
+         done++;
+      }
+      if(put_user((s32)ret, &(entries[i].result))){
+         return done > 0 ? done : -EFAULT;
+      }
+  }
+
+  return done;
+}
+
+/* ioctl operation of the driver */
+static long dev_ioctl(struct file *filp, unsigned int command, unsigned long param) {
+
+  int minor = get_minor(filp);
+  flow_session *session = filp->private_data;
+  object_state *the_object;
+
+  the_object = objects + minor;
+
+  /*
+   List of commands:
+      0 : change priority for the session
+      1 : change timeout for the session
+      3 : blocking/non-blocking operations for the session
+      4 : resize the buffers of both flows of a given minor
+      5 : doorbell after the indices of the flow of the current priority were moved through a mapping
+      6 : enable/disable the logging of the operations for a given minor
+      7 : enable/disable the single producer/single consumer mode for a given minor
+      8 : enable/disable the per-cpu sharded mode of the high priority flow for a given minor
+      9 : set the record mode of a given minor: 0 byte stream, 1 messages truncated, 2 messages rejected when they do not fit
+      10 : set the broadcast mode of a given minor: 0 disabled, otherwise the lag limit in bytes of the readers
+      11 : enable/disable the overwrite mode for a given minor, the writers evict the oldest data instead of waiting
+      12 : change the priority of the sessions opened later on a given minor
+      13 : change the timeout of the sessions opened later on a given minor
+      14 : blocking/non-blocking operations of the sessions opened later on a given minor
+      15 : batch of non-blocking reads or writes on the flows of many minors, see struct multi_flow_batch
+      16 : change the low watermark of the reads for the session, 0 to wait for the whole read
+      17 : change timeout for the session in nanoseconds, the value is a __u64
+      18 : get the nanoseconds left of the timeout of the session after its last read or write, as a __u64
+  */
+
+  // Called change priority of the session
+  if(command == 0){
+      int priority;
+      if(get_user(priority,(int*)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update priority of the session with value %d\n",MODNAME,get_major(filp),get_minor(filp),priority);
+      trace_multi_flow_ioctl(minor,command,priority);
+      if(priority != 0 && priority != 1){
+         return -EINVAL;
+      }
+      // Update priority of the session, the other sessions of the minor keep their own
+      WRITE_ONCE(session->prio, priority);
+
+      // Pollers are waiting on the queues of the old flow
+      wake_up_all(&(the_object->poll_queue[0]));
+      wake_up_all(&(the_object->poll_queue[1]));
+  }else if (command == 1){
+      int timer;
+      if(get_user(timer,(int*)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update wait queue timeout of the session with value %d\n",MODNAME,get_major(filp),get_minor(filp),timer);
+      trace_multi_flow_ioctl(minor,command,timer);
+      if(timer < 0){
+         return -EINVAL;
+      }
+      // Update timeout of the session, kept in ns
+      WRITE_ONCE(session->timeout, (u64)timer * NSEC_PER_SEC);
+  }else if (command == 3){
+      int block;
+      if(get_user(block,(int*)param)){
+         return -EFAULT;
+      }
+      block = block ? 1 : 0;
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update blocking param of the session with value %d\n",MODNAME,get_major(filp),get_minor(filp),block);
+      trace_multi_flow_ioctl(minor,command,block);
+      // Update blocking of the session
+      WRITE_ONCE(session->blocking, block);
+      
+      // The sleeping operations of the session return, the ones of the other sessions go back to sleep
+      if(block == 1){
+         wake_up_all(&(the_object->rd_queue[0]));
+         wake_up_all(&(the_object->rd_queue[1]));
+         wake_up_all(&(the_object->wt_queue[0]));
+         wake_up_all(&(the_object->wt_queue[1]));
+         wake_up_all(&(the_object->poll_queue[0]));
+         wake_up_all(&(the_object->poll_queue[1]));
+         wake_up_all(&(the_object->pending_queue));
+         // The deferred writes of the session waiting for room are truncated
+         deferred_kick(the_object);
+      }
+  }else if (command == 4){
+      int capacity;
+      int ret;
+      if(get_user(capacity,(int*)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Resize buffers to %d bytes\n",MODNAME,get_major(filp),get_minor(filp),capacity);
+      trace_multi_flow_ioctl(minor,command,capacity);
+      if(capacity <= 0 || capacity > OBJECT_CAPACITY_LIMIT){
+         return -EINVAL;
+      }
+      capacity = roundup_pow_of_two(max_t(int, capacity, PAGE_SIZE));
+
+      // Resize both flows or none of them, the valid bytes are kept
+      ret = ring_resize(the_object,capacity);
+      if(ret != 0){
+         return ret;
+      }
+  }else if (command == 5){
+      int priority = READ_ONCE(session->prio);
+
+      // Update parameter array of valid bytes
+      if(priority == 0){
+         bytes_high[minor] = flow_valid(the_object,priority);
+      }else if (priority == 1){
+         bytes_low[minor] = flow_valid(the_object,priority);
+      }
+
+      // Data or space could be available, wake up the readers and writers of the flow that can complete
+      flow_wake_readers(the_object,priority);
+      flow_wake_writers(the_object,priority);
+  }else if (command == 6){
+      int debug;
+      if(get_user(debug,(int*)param)){
+         return -EFAULT;
+      }
+      debug = debug ? 1 : 0;
+      trace_multi_flow_ioctl(minor,command,debug);
+
+      // The static key counts the minors with logging enabled
+      mutex_lock(&flow_debug_mutex);
+      if(debug && !the_object->debug){
+         static_branch_inc(&flow_debug_key);
+      }else if(!debug && the_object->debug){
+         static_branch_dec(&flow_debug_key);
+      }
+      WRITE_ONCE(the_object->debug, debug);
+      mutex_unlock(&flow_debug_mutex);
+
+      printk("%s: logging %s on dev with [major,minor] number [%d,%d]\n",MODNAME,debug ? "enabled" : "disabled",get_major(filp),get_minor(filp));
+  }else if (command == 7){
+      int spsc;
+      if(get_user(spsc,(int*)param)){
+         return -EFAULT;
+      }
+      spsc = spsc ? 1 : 0;
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update spsc mode with value %d\n",MODNAME,get_major(filp),get_minor(filp),spsc);
+      trace_multi_flow_ioctl(minor,command,spsc);
+
+      // Under the locks of both flows, so the buffers are not being resized or reclaimed
+      flow_lock(the_object,0);
+      flow_lock(the_object,1);
+      // The lockless writer uses the ring buffer, not the shards, and stores no messages, the lockless reader moves the head
+      if(spsc && (the_object->shards != NULL || the_object->record || the_object->broadcast || the_object->overwrite)){
+         flow_unlock(the_object,1);
+         flow_unlock(the_object,0);
+         return -EBUSY;
+      }
+      smp_store_release(&(the_object->spsc), spsc);
+      if(spsc == 0){
+         // The buffers can change as soon as the locks are released
+         spsc_drain(the_object);
+      }
+      flow_unlock(the_object,1);
+      flow_unlock(the_object,0);
+  }else if (command == 8){
+      int sharded;
+      int ret;
+      if(get_user(sharded,(int*)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update sharded mode with value %d\n",MODNAME,get_major(filp),get_minor(filp),sharded);
+      trace_multi_flow_ioctl(minor,command,sharded);
+
+      ret = sharded ? shards_enable(the_object) : shards_disable(the_object);
+      if(ret != 0){
+         return ret;
+      }
+
+      // Writers waiting for room in the ring buffer now wait for their shard, or the opposite
+      wake_up_all(&(the_object->wt_queue[0]));
+  }else if (command == 9){
+      int record;
+      int busy;
+      if(get_user(record,(int*)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update record mode with value %d\n",MODNAME,get_major(filp),get_minor(filp),record);
+      trace_multi_flow_ioctl(minor,command,record);
+      if(record < 0 || record > 2){
+         return -EINVAL;
+      }
+
+      flow_lock(the_object,0);
+      flow_lock(the_object,1);
+      // The bytes in the flows can not be turned into messages or the opposite, going from truncate to reject is always allowed
+      busy = (record != 0) != (the_object->record != 0) &&
+         (flow_valid(the_object,0) != 0 || flow_valid(the_object,1) != 0 || atomic_read(&(the_object->pending)) != 0);
+      // The lockless, sharded and mapped writers store no messages
+      busy = busy || (record && (the_object->spsc || the_object->shards != NULL ||
+         atomic_read(&(the_object->mapped[0])) != 0 || atomic_read(&(the_object->mapped[1])) != 0));
+      if(!busy){
+         WRITE_ONCE(the_object->record, record);
+      }
+      flow_unlock(the_object,1);
+      flow_unlock(the_object,0);
+      if(busy){
+         return -EBUSY;
+      }
+
+      // Readers and writers waiting for bytes now wait for messages, or the opposite
+      wake_up_all(&(the_object->rd_queue[0]));
+      wake_up_all(&(the_object->rd_queue[1]));
+      wake_up_all(&(the_object->wt_queue[0]));
+      wake_up_all(&(the_object->wt_queue[1]));
+      deferred_kick(the_object);
+  }else if (command == 10){
+      int broadcast;
+      flow_session *session;
+      struct multi_flow_ring *ring;
+      int i;
+      if(get_user(broadcast,(int*)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update broadcast mode with value %d\n",MODNAME,get_major(filp),get_minor(filp),broadcast);
+      trace_multi_flow_ioctl(minor,command,broadcast);
+      if(broadcast < 0){
+         return -EINVAL;
+      }
+
+      flow_lock(the_object,0);
+      flow_lock(the_object,1);
+      // The lockless and mapped readers and the overwriting writers move the head and the shards have no cursors
+      if(broadcast && (the_object->spsc || the_object->shards != NULL || the_object->overwrite ||
+         atomic_read(&(the_object->mapped[0])) != 0 || atomic_read(&(the_object->mapped[1])) != 0)){
+         flow_unlock(the_object,1);
+         flow_unlock(the_object,0);
+         return -EBUSY;
+      }
+      spin_lock(&(the_object->broadcast_lock));
+      if(broadcast && !the_object->broadcast){
+         // Every subscriber starts from the data already in the flows
+         list_for_each_entry(session,&(the_object->subscribers),link){
+            for(i=0;i<2;i++){
+               ring = the_object->ring[i];
+               WRITE_ONCE(session->cursor[i], ring == NULL ? 0 : ring->head);
+            }
+            session->dropped = 0;
+         }
+      }
+      WRITE_ONCE(the_object->broadcast, broadcast);
+      spin_unlock(&(the_object->broadcast_lock));
+      flow_unlock(the_object,1);
+      flow_unlock(the_object,0);
+
+      // Readers waiting for the data of the flow now wait for the data after their cursor, or the opposite
+      wake_up_all(&(the_object->rd_queue[0]));
+      wake_up_all(&(the_object->rd_queue[1]));
+      wake_up_all(&(the_object->poll_queue[0]));
+      wake_up_all(&(the_object->poll_queue[1]));
+  }else if (command == 11){
+      int overwrite;
+      if(get_user(overwrite,(int*)param)){
+         return -EFAULT;
+      }
+      overwrite = overwrite ? 1 : 0;
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update overwrite mode with value %d\n",MODNAME,get_major(filp),get_minor(filp),overwrite);
+      trace_multi_flow_ioctl(minor,command,overwrite);
+
+      flow_lock(the_object,0);
+      flow_lock(the_object,1);
+      // The head is moved without the readers lock by the lockless and mapped readers and by the subscribers, the shards are not evicted
+      if(overwrite && (the_object->spsc || the_object->shards != NULL || the_object->broadcast ||
+         atomic_read(&(the_object->mapped[0])) != 0 || atomic_read(&(the_object->mapped[1])) != 0)){
+         flow_unlock(the_object,1);
+         flow_unlock(the_object,0);
+         return -EBUSY;
+      }
+      WRITE_ONCE(the_object->overwrite, overwrite);
+      flow_unlock(the_object,1);
+      flow_unlock(the_object,0);
+
+      // Writers waiting for room now evict the oldest data
+      if(overwrite){
+         wake_up_all(&(the_object->wt_queue[0]));
+         wake_up_all(&(the_object->wt_queue[1]));
+         deferred_kick(the_object);
+         wake_up_all(&(the_object->pending_queue));
+      }
+  }else if (command == 12){
+      int priority;
+      if(get_user(priority,(int*)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update default priority with value %d\n",MODNAME,get_major(filp),get_minor(filp),priority);
+      trace_multi_flow_ioctl(minor,command,priority);
+      if(priority != 0 && priority != 1){
+         return -EINVAL;
+      }
+      // The sessions already open keep their priority
+      WRITE_ONCE(the_object->prio, priority);
+  }else if (command == 13){
+      int timer;
+      if(get_user(timer,(int*)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update default wait queue timeout with value %d\n",MODNAME,get_major(filp),get_minor(filp),timer);
+      trace_multi_flow_ioctl(minor,command,timer);
+      if(timer < 0){
+         return -EINVAL;
+      }
+      WRITE_ONCE(the_object->timeout, (u64)timer * NSEC_PER_SEC);
+  }else if (command == 14){
+      int block;
+      if(get_user(block,(int*)param)){
+         return -EFAULT;
+      }
+      block = block ? 1 : 0;
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update default blocking param with value %d\n",MODNAME,get_major(filp),get_minor(filp),block);
+      trace_multi_flow_ioctl(minor,command,block);
+      WRITE_ONCE(the_object->blocking, block);
+  }else if (command == 15){
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Batch of operations on many minors\n",MODNAME,get_major(filp),get_minor(filp));
+      trace_multi_flow_ioctl(minor,command,0);
+      return flow_batch(filp,(struct multi_flow_batch __user *)param);
+  }else if (command == 16){
+      int lowat;
+      if(get_user(lowat,(int*)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update read low watermark of the session with value %d\n",MODNAME,get_major(filp),get_minor(filp),lowat);
+      trace_multi_flow_ioctl(minor,command,lowat);
+      if(lowat < 0){
+         return -EINVAL;
+      }
+      WRITE_ONCE(session->lowat, lowat);
+
+      // A reader sleeping in poll could already be satisfied
+      wake_up_all(&(the_object->poll_queue[READ_ONCE(session->prio)]));
+  }else if (command == 17){
+      u64 timeout;
+      if(get_user(timeout,(u64 __user *)param)){
+         return -EFAULT;
+      }
+      flow_log(the_object,"%s: Called an ioctl on dev with [major,minor] number [%d,%d]. Update wait queue timeout of the session with value %llu ns\n",MODNAME,get_major(filp),get_minor(filp),timeout);
+      trace_multi_flow_ioctl(minor,command,(int)min_t(u64, timeout, INT_MAX));
+      // A retry can pass the time left of the previous operation, see command 18
+      WRITE_ONCE(session->timeout, timeout);
+      WRITE_ONCE(session->remaining, timeout);
+  }else if (command == 18){
+      if(put_user(READ_ONCE(session->remaining),(u64 __user *)param)){
+         return -EFAULT;
+      }
+  }else{
+      // Invalid command
+      flow_log(the_object,"%s : Called an ioctl on dev with [major,minor] number [%d,%d] with invalid command %u\n",MODNAME,get_major(filp),get_minor(filp),command);
+  }
+
+  return 0;
+
+}
+
+/*
+   Reserve room for a deferred write of len bytes in the queue of the dev.
+   A write is always accepted on an empty queue, so one larger than deferred_max_bytes can still go.
+   Return 1 if the write is accepted.
+*/
+static int deferred_reserve(object_state *the_object, int len){
+
+   int accepted = 0;
+
+   spin_lock(&(the_object->deferred_lock));
+   if(atomic_read(&(the_object->pending)) == 0 ||
+      (atomic_read(&(the_object->pending)) < deferred_max_writes && the_object->pending_bytes + len <= deferred_max_bytes)){
+      atomic_inc(&(the_object->pending));
+      the_object->pending_bytes += len;
+      the_object->pending_max = max(the_object->pending_max, atomic_read(&(the_object->pending)));
+      the_object->pending_bytes_max = max(the_object->pending_bytes_max, the_object->pending_bytes);
+      pending_low[the_object->minor] = atomic_read(&(the_object->pending));
+      pending_bytes_low[the_object->minor] = the_object->pending_bytes;
+      accepted = 1;
+   }
+   spin_unlock(&(the_object->deferred_lock));
+
+   return accepted;
+}
+
+/* Release the room of a deferred write, when writes is 0 only the bytes are given back */
+static void deferred_release(object_state *the_object, int writes, int len){
+
+   spin_lock(&(the_object->deferred_lock));
+   atomic_sub(writes,&(the_object->pending));
+   the_object->pending_bytes -= len;
+   pending_low[the_object->minor] = atomic_read(&(the_object->pending));
+   pending_bytes_low[the_object->minor] = the_object->pending_bytes;
+   spin_unlock(&(the_object->deferred_lock));
+
+   // Wake up writers waiting for room in the deferred queue
+   wake_up_all(&(the_object->pending_queue));
+}
+
+/*
+   Function used to queue delayed write, the data is copied now and appended later by the work of the dev.
+   With nowait it fails with -EAGAIN instead of sleeping for room in the deferred queue.
+*/
+int put_work(object_state *the_object,flow_session *session,struct iov_iter *from,int len,int nowait){
+
+   packed_task *the_task;
+   size_t copied;
+   ktime_t deadline = 0;
+   int reserved;
+   int pending_bytes;
+   int ret;
+
+   // Check the limits of the deferred queue, blocking devs wait for room unless the writers never wait in overwrite mode
+   reserved = deferred_reserve(the_object,len);
+   while(!reserved){
+      if(session_nonblocking(session) || nowait || READ_ONCE(the_object->overwrite)){
+         return -EAGAIN;
+      }
+
+      flow_log(the_object,"%s : deferred queue full on dev with minor %d, go to sleep\n",MODNAME,the_object->minor);
+      flow_stat_inc(the_object,sleeps,1);
+      if(session->timeout > 0){
+         if(deadline == 0){
+            deadline = flow_deadline(session->timeout);
+         }
+         // The write fails if the room is not available before the deadline
+         ret = wait_event_hrtimeout(the_object->pending_queue, session_nonblocking(session) || READ_ONCE(the_object->overwrite) || (reserved = deferred_reserve(the_object,len)), ktime_sub(deadline, ktime_get()));
+         session_remaining(session,deadline);
+         if(ret == -ETIME){
+            flow_stat_inc(the_object,timeouts,1);
+            return -EAGAIN;
+         }
+      }else{
+         wait_event(the_object->pending_queue, session_nonblocking(session) || READ_ONCE(the_object->overwrite) || (reserved = deferred_reserve(the_object,len)));
+      }
+      flow_stat_inc(the_object,wakeups,1);
+   }
+
+   // Try to lock module
+   if(!try_module_get(THIS_MODULE)){
+      deferred_release(the_object,1,len);
+      return -ENODEV;
+   }
+
+
+   flow_log(the_object,"%s: requested deferred write on dev with minor %d\n",MODNAME,the_object->minor);
+
+   // Alloc memory for the task and the copy of the data, without reclaim for a non-blocking iocb
+   the_task = kvmalloc(sizeof(packed_task) + len,nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL);
+   if (the_task == NULL) {
+      if(!nowait){
+         printk("%s: deferred write buffer allocation failure\n",MODNAME);
+      }
+      deferred_release(the_object,1,len);
+      module_put(THIS_MODULE);
+      return nowait ? -EAGAIN : -ENOMEM;
+   }
+
+   // Copy data from the user segments, the user buffers can be reused as soon as the write returns
+   copied = copy_from_iter(the_task->to_write,len,from);
+   if(copied != len){
+      flow_log(the_object,"%s : Error in deferred write, could only copy %zu bytes of %d",MODNAME,copied,len);
+      if(copied == 0){
+         deferred_release(the_object,1,len);
+         kvfree(the_task);
+         module_put(THIS_MODULE);
+         return -EFAULT;
+      }
+      deferred_release(the_object,0,len - copied);
+      len = copied;
+   }
+   the_task->bytes_to_write = len;
+   the_task->file = get_file(session->file);
+   the_task->blocking = session_nonblocking(session);
+   the_task->timeout = READ_ONCE(session->timeout);
+   the_task->queued = ktime_get();
+   the_task->wait_start = 0;
+   the_task->deadline = 0;
+
+   // Queue the task, all the tasks queued before the work runs are appended in one batch, the work can free it as soon as the lock is released
+   spin_lock(&(the_object->deferred_lock));
+   list_add_tail(&(the_task->list),&(the_object->deferred_list));
+   pending_bytes = the_object->pending_bytes;
+   spin_unlock(&(the_object->deferred_lock));
+
+   trace_multi_flow_defer(the_object->minor,1,len,pending_bytes);
+
+   // Run now also if the work is delayed to the deadline of a write waiting for room
+   mod_delayed_work(deferred_wq,&(the_object->deferred_work),0);
+
+   return len;
+}
+
+/*
+   Delayed work for the low priority writes, it appends all the queued writes of the dev in order.
+   The work never sleeps: a blocking write that does not fit stays at the head of the deferred queue
+   with the ones behind it, and the readers of the flow run the work again when they free room.
+   With a timeout the work runs also at the deadline of the write, which is then truncated as on a non-blocking dev.
+*/
+void low_prio_write(struct work_struct *work){
+
+   object_state *the_object = container_of(to_delayed_work(work),object_state,deferred_work);
+   int minor = the_object->minor;
+   packed_task *the_task, *next;
+   size_t len;
+   int record;
+   int expired;
+   int parked = 0;
+   unsigned long delay = 0;
+   LIST_HEAD(batch);
+
+   // Take all the writes queued so far, the ones queued later will run the work again
+   spin_lock(&(the_object->deferred_lock));
+   list_splice_init(&(the_object->deferred_list),&batch);
+   spin_unlock(&(the_object->deferred_lock));
+
+   // Get the lock for opertion on the device
+   mutex_lock(&(the_object->write_synchronizer[1]));
+   flow_log(the_object,"%s: called low priority write batch on dev with minor %d, starting from offest %d\n",MODNAME,the_object->minor,flow_valid(the_object,1));
+
+   list_for_each_entry_safe(the_task,next,&batch,list){
+
+      len = the_task->bytes_to_write;
+      expired = 0;
+
+      // The mode does not change while the write is pending, but it could have changed since the write was queued
+      record = the_object->record;
+      if(record_size(record,len) > the_object->capacity[1]){
+         len = record_fit(record,the_object->capacity[1]);
+      }
+
+      // Check if the write reaches memory bound,then resize the write or leave it queued
+      while(record_size(record,len) > flow_free(the_object,1)){
+
+         // In overwrite mode the oldest data makes room
+         if(the_object->overwrite){
+            flow_evict(the_object,1,record_size(record,len),record,0);
+            break;
+         }
+
+         // In broadcast mode drop the subscribers over the lag limit first
+         if(the_object->broadcast){
+            broadcast_make_room(the_object,1);
+            if(record_size(record,len) <= flow_free(the_object,1)){
+               break;
+            }
+         }
+
+         // Case object is non-blocking, also if the session turned so after the write was queued, or the timeout of the write expired while it waited for room
+         expired = the_task->deadline != 0 && !ktime_before(ktime_get(),the_task->deadline);
+         if(the_task->blocking == 1 || session_nonblocking(the_task->file->private_data) || expired){
+            // Set the len of bytes to write to max remaining bytes, a message is truncated or dropped
+            len = record == 2 ? 0 : record_fit(record,flow_free(the_object,1));
+            break;
+         }
+
+         parked = 1;
+         break;
+      }
+
+      if(parked){
+         // The write and the ones behind it wait in the deferred queue, the time is counted from the first try
+         if(the_task->wait_start == 0){
+            the_task->wait_start = ktime_get();
+            // The timeout is a budget for the whole wait, taken once
+            the_task->deadline = flow_deadline(the_task->timeout);
+            if(trace_multi_flow_wait_enter_enabled()){
+               trace_multi_flow_wait_enter(minor,1,1,len,flow_valid(the_object,1),the_task->timeout);
+            }
+            flow_stat_inc(the_object,sleeps,1);
+         }
+         if(the_task->deadline != 0){
+            delay = nsecs_to_jiffies(max_t(s64, ktime_to_ns(ktime_sub(the_task->deadline, ktime_get())), 0)) + 1;
+         }
+         flow_log(the_object,"%s : Insufficient space of buffer to write low priority on dev with minor number %d, the write stays queued\n",MODNAME,minor);
+         break;
+      }
+
+      // Time spent waiting for room since the first try
+      if(the_task->wait_start != 0){
+         flow_latency_record(the_object->latency->wt_wait[1],the_task->wait_start);
+         if(trace_multi_flow_wait_exit_enabled()){
+            trace_multi_flow_wait_exit(minor,1,1,len,flow_valid(the_object,1),expired);
+         }
+         if(expired){
+            flow_stat_inc(the_object,timeouts,1);
+         }else{
+            flow_stat_inc(the_object,wakeups,1);
+         }
+      }
+
+      // Copy data from the task to the tail of the kernel ring buffer
+      if(!record){
+         ring_append(the_object,1,the_task->to_write,len);
+      }else if(len != 0){
+         record_write(the_object,1,NULL,the_task->to_write,len);
+      }
+      flow_latency_record(the_object->latency->deferred,the_task->queued);
+
+      if(trace_multi_flow_deferred_write_enabled()){
+         trace_multi_flow_deferred_write(minor,1,len,flow_valid(the_object,1));
+      }
+      flow_stat_inc(the_object,writes,1);
+      flow_stat_add(the_object,bytes_written,1,len);
+      if(len < the_task->bytes_to_write){
+         flow_stat_inc(the_object,short_writes,1);
+      }
+
+      // Give back the room of the write, also the bytes dropped by a non-blocking dev
+      deferred_release(the_object,1,the_task->bytes_to_write);
+
+      list_del(&(the_task->list));
+      fput(the_task->file);
+      kvfree(the_task);
+
+      // Release lock module
+      module_put(THIS_MODULE);
+   }
+
+   // The writes not done go back before the ones queued meanwhile, they stay pending so a reader freeing room runs the work again
+   if(parked){
+      spin_lock(&(the_object->deferred_lock));
+      list_splice(&batch,&(the_object->deferred_list));
+      spin_unlock(&(the_object->deferred_lock));
+      // A write with a timeout is truncated at its deadline if no reader frees room before, a run queued meanwhile is kept
+      if(delay != 0){
+         queue_delayed_work(deferred_wq,&(the_object->deferred_work),delay);
+      }
+   }
+
+   // Update parameter array of valid bytes
+   bytes_low[minor] = flow_valid(the_object,1);
+
+   // Wake up the processes waiting in read queue low prio that the new data can satisfy
+   flow_wake_readers(the_object,1);
+
+   flow_log(the_object,"%s: Done low priority write batch. Valid bytes are now %d on dev with minor %d\n",MODNAME,flow_valid(the_object,1),the_object->minor);
+
+   // Release the lock for operations on the device
+   mutex_unlock(&(the_object->write_synchronizer[1]));
+
+}
+
+/* Periodic release of the buffers of the minors unused since idle_reclaim_secs seconds */
+static void reclaim_idle(struct work_struct *work);
+static DECLARE_DELAYED_WORK(reclaim_work, reclaim_idle);
+
+static void reclaim_idle(struct work_struct *work){
+
+   int i;
+   unsigned long pages = 0;
+
+   for(i=0;i<MINORS;i++){
+      pages += ring_reclaim(&objects[i],0,1);
+      pages += ring_reclaim(&objects[i],1,1);
+   }
+
+   if(pages > 0){
+      printk("%s: released %lu pages of idle buffers\n",MODNAME,pages);
+   }
+
+   schedule_delayed_work(&reclaim_work, idle_reclaim_secs*HZ);
+}
+
+/* Shrinker count: pages of the buffers that are empty and not in use */
+static unsigned long flows_count(struct shrinker *shrinker, struct shrink_control *sc){
+
+   int i, priority;
+   unsigned long pages = 0;
+
+   for(i=0;i<MINORS;i++){
+      if(atomic_read(&objects[i].sessions) != 0 || atomic_read(&objects[i].pending) != 0){
+         continue;
+      }
+      for(priority=0;priority<2;priority++){
+         if(objects[i].stream_content[priority] != NULL && flow_valid(&objects[i],priority) == 0){
+            pages += objects[i].capacity[priority] >> PAGE_SHIFT;
+         }
+      }
+   }
+
+   return pages;
+}
+
+/* Shrinker scan: release the buffers of empty flows without waiting for the idle time */
+static unsigned long flows_scan(struct shrinker *shrinker, struct shrink_control *sc){
+
+   int i;
+   unsigned long freed = 0;
+
+   for(i=0;i<MINORS && freed < sc->nr_to_scan;i++){
+      freed += ring_reclaim(&objects[i],0,0);
+      freed += ring_reclaim(&objects[i],1,0);
+   }
+
+   return freed > 0 ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *flows_shrinker;
+#else
+static struct shrinker flows_shrinker_struct = {
+  .count_objects = flows_count,
+  .scan_objects = flows_scan,
+  .seeks = DEFAULT_SEEKS
+};
+static struct shrinker *flows_shrinker = &flows_shrinker_struct;
+#endif
+
+/* Register the shrinker of the buffers */
+static int flows_shrinker_register(void){
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+   flows_shrinker = shrinker_alloc(0, "multi-flow");
+   if(flows_shrinker == NULL){
+      return -ENOMEM;
+   }
+   flows_shrinker->count_objects = flows_count;
+   flows_shrinker->scan_objects = flows_scan;
+   shrinker_register(flows_shrinker);
+   return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+   return register_shrinker(flows_shrinker, "multi-flow");
+#else
+   return register_shrinker(flows_shrinker);
+#endif
+}
+
+static void flows_shrinker_unregister(void){
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+   shrinker_free(flows_shrinker);
+#else
+   unregister_shrinker(flows_shrinker);
+#endif
+}
+
+/*
+   Statistics in debugfs: multi_flow/<minor>/stats for every minor
+   and multi_flow/stats with the sum of all the minors.
+*/
+static struct dentry *flow_debugfs;
+
+// Add the counters of all the cpus of a dev to sum
+static void flow_stats_sum(object_state *the_object, flow_stats *sum){
+
+   int cpu;
+   int i;
+
+   for_each_possible_cpu(cpu){
+      u64 *counters = (u64*)per_cpu_ptr(the_object->stats,cpu);
+      for(i=0;i<sizeof(flow_stats)/sizeof(u64);i++){
+         ((u64*)sum)[i] += counters[i];
+      }
+   }
+}
+
+static void flow_stats_print(struct seq_file *m, flow_stats *sum, int *waiting, int *valid){
+
+   seq_printf(m,"%-18s %20s %20s\n","","high","low");
+   seq_printf(m,"%-18s %20llu %20llu\n","bytes_written",sum->bytes_written[0],sum->bytes_written[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","writes",sum->writes[0],sum->writes[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","short_writes",sum->short_writes[0],sum->short_writes[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","bytes_read",sum->bytes_read[0],sum->bytes_read[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","reads",sum->reads[0],sum->reads[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","short_reads",sum->short_reads[0],sum->short_reads[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","sleeps",sum->sleeps[0],sum->sleeps[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","timeouts",sum->timeouts[0],sum->timeouts[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","wakeups",sum->wakeups[0],sum->wakeups[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","dropped_readers",sum->dropped_readers[0],sum->dropped_readers[1]);
+   seq_printf(m,"%-18s %20llu %20llu\n","overwritten",sum->overwritten[0],sum->overwritten[1]);
+   seq_printf(m,"%-18s %20d %20d\n","waiting",waiting[0],waiting[1]);
+   seq_printf(m,"%-18s %20d %20d\n","valid",valid[0],valid[1]);
+}
+
+// Deferred queue of the low priority flow: current depth and high-water marks
+static void flow_pending_print(struct seq_file *m, int pending, int pending_bytes, int pending_max, int pending_bytes_max){
+
+   seq_printf(m,"%-18s %20d\n","pending",pending);
+   seq_printf(m,"%-18s %20d\n","pending_bytes",pending_bytes);
+   seq_printf(m,"%-18s %20d\n","pending_max",pending_max);
+   seq_printf(m,"%-18s %20d\n","pending_bytes_max",pending_bytes_max);
+}
+
+static int flow_stats_show(struct seq_file *m, void *v){
+
+   object_state *the_object = m->private;
+   flow_stats sum = {0};
+   int waiting[2];
+   int valid[2];
+   int pending, pending_bytes, pending_max, pending_bytes_max;
+   int i;
+
+   flow_stats_sum(the_object,&sum);
+   for(i=0;i<2;i++){
+      waiting[i] = atomic_read(&(the_object->waiting[i]));
+      valid[i] = flow_valid(the_object,i);
+   }
+
+   spin_lock(&(the_object->deferred_lock));
+   pending = atomic_read(&(the_object->pending));
+   pending_bytes = the_object->pending_bytes;
+   pending_max = the_object->pending_max;
+   pending_bytes_max = the_object->pending_bytes_max;
+   spin_unlock(&(the_object->deferred_lock));
+
+   flow_stats_print(m,&sum,waiting,valid);
+   flow_pending_print(m,pending,pending_bytes,pending_max,pending_bytes_max);
+
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(flow_stats);
+
+static int flows_stats_show(struct seq_file *m, void *v){
+
+   flow_stats sum = {0};
+   int waiting[2] = {0};
+   int valid[2] = {0};
+   int pending = 0, pending_bytes = 0, pending_max = 0, pending_bytes_max = 0;
+   int minor;
+   int i;
+
+   for(minor=0;minor<MINORS;minor++){
+      object_state *the_object = objects + minor;
+
+      flow_stats_sum(the_object,&sum);
+      for(i=0;i<2;i++){
+         waiting[i] += atomic_read(&(the_object->waiting[i]));
+         valid[i] += flow_valid(the_object,i);
+      }
+
+      spin_lock(&(the_object->deferred_lock));
+      pending += atomic_read(&(the_object->pending));
+      pending_bytes += the_object->pending_bytes;
+      pending_max = max(pending_max, the_object->pending_max);
+      pending_bytes_max = max(pending_bytes_max, the_object->pending_bytes_max);
+      spin_unlock(&(the_object->deferred_lock));
+   }
+
+   flow_stats_print(m,&sum,waiting,valid);
+   flow_pending_print(m,pending,pending_bytes,pending_max,pending_bytes_max);
+
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(flows_stats);
+
+/*
+   Latency histograms in debugfs: multi_flow/<minor>/latency, writing to the file resets
+   the histograms of the minor and writing to multi_flow/latency_reset resets all of them.
+*/
+static void flow_latency_reset(object_state *the_object){
+
+   atomic_long_t *histogram = (atomic_long_t*)the_object->latency;
+   int i;
+
+   for(i=0;i<sizeof(flow_latency)/sizeof(atomic_long_t);i++){
+      atomic_long_set(&histogram[i],0);
+   }
+}
+
+// Upper bound in ns of the bucket reached by permille of the waits
+static u64 flow_latency_percentile(unsigned long *counts, unsigned long total, int permille){
+
+   unsigned long target = DIV_ROUND_UP(total*permille,1000);
+   unsigned long sum = 0;
+   int i;
+
+   if(total == 0){
+      return 0;
+   }
+   for(i=0;i<LATENCY_BUCKETS-1;i++){
+      sum += counts[i];
+      if(sum >= target){
+         break;
+      }
+   }
+   return 1ULL << (i+1);
+}
+
+static void flow_latency_print(struct seq_file *m, const char *name, atomic_long_t *histogram){
+
+   unsigned long counts[LATENCY_BUCKETS];
+   unsigned long total = 0;
+   int i;
+
+   for(i=0;i<LATENCY_BUCKETS;i++){
+      counts[i] = atomic_long_read(&histogram[i]);
+      total += counts[i];
+   }
+
+   seq_printf(m,"%s: count %lu p50 %llu p99 %llu p999 %llu ns\n",name,total,
+      flow_latency_percentile(counts,total,500),
+      flow_latency_percentile(counts,total,990),
+      flow_latency_percentile(counts,total,999));
+   for(i=0;i<LATENCY_BUCKETS;i++){
+      if(counts[i] != 0){
+         seq_printf(m,"   %20llu - %20llu ns %lu\n",i == 0 ? 0 : 1ULL << i,(1ULL << (i+1)) - 1,counts[i]);
+      }
+   }
+}
+
+static int flow_latency_show(struct seq_file *m, void *v){
+
+   object_state *the_object = m->private;
+
+   flow_latency_print(m,"rd_wait_high",the_object->latency->rd_wait[0]);
+   flow_latency_print(m,"rd_wait_low",the_object->latency->rd_wait[1]);
+   flow_latency_print(m,"wt_wait_high",the_object->latency->wt_wait[0]);
+   flow_latency_print(m,"wt_wait_low",the_object->latency->wt_wait[1]);
+   flow_latency_print(m,"deferred",the_object->latency->deferred);
+
+   return 0;
+}
+
+static int flow_latency_open(struct inode *inode, struct file *file){
+   return single_open(file,flow_latency_show,inode->i_private);
+}
+
+static ssize_t flow_latency_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos){
+
+   struct seq_file *m = file->private_data;
+
+   flow_latency_reset(m->private);
+   return count;
+}
+
+static const struct file_operations flow_latency_fops = {
+  .owner = THIS_MODULE,
+  .open = flow_latency_open,
+  .read = seq_read,
+  .write = flow_latency_write,
+  .llseek = seq_lseek,
+  .release = single_release
+};
+
+static ssize_t flows_latency_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos){
+
+   int i;
+
+   for(i=0;i<MINORS;i++){
+      flow_latency_reset(&objects[i]);
+   }
+   return count;
+}
+
+static const struct file_operations flows_latency_reset_fops = {
+  .owner = THIS_MODULE,
+  .write = flows_latency_reset_write,
+  .llseek = noop_llseek
+};
+
+static void flows_debugfs_create(void){
+
+   char name[8];
+   struct dentry *dir;
+   int i;
+
+   // Failures of debugfs are not fatal, the files are simply missing
+   flow_debugfs = debugfs_create_dir("multi_flow", NULL);
+   debugfs_create_file("stats", 0444, flow_debugfs, NULL, &flows_stats_fops);
+   debugfs_create_file("latency_reset", 0200, flow_debugfs, NULL, &flows_latency_reset_fops);
+
+   for(i=0;i<MINORS;i++){
+      snprintf(name,sizeof(name),"%d",i);
+      dir = debugfs_create_dir(name, flow_debugfs);
+      debugfs_create_file("stats", 0444, dir, &objects[i], &flow_stats_fops);
+      debugfs_create_file("latency", 0644, dir, &objects[i], &flow_latency_fops);
+   }
+}
+
+/*
+   Free the counters, the histograms, the shards and the semaphores of the sharded mode of all the devs,
+   free_percpu, kfree and percpu_free_rwsem ignore the ones not allocated
+*/
+static void flows_state_free(void){
+
+   int i;
+
+   for(i=0;i<MINORS;i++){
+      free_percpu(objects[i].stats);
+      objects[i].stats = NULL;
+      kfree(objects[i].latency);
+      objects[i].latency = NULL;
+      if(objects[i].shards != NULL){
+         shards_free(&objects[i],objects[i].shards);
+         objects[i].shards = NULL;
+      }
+      percpu_free_rwsem(&(objects[i].shard_sem));
+   }
+}
+
+static struct file_operations fops = {
+  .owner = THIS_MODULE,
+  .write_iter = dev_write_iter,
+  .read_iter = dev_read_iter,
+  // splice moves the data between the flow and the pipe pages through read_iter/write_iter, without user buffers
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+  .splice_read = copy_splice_read,
+#else
+  .splice_read = generic_file_splice_read,
+#endif
+  .splice_write = iter_file_splice_write,
+  .open =  dev_open,
+  .release = dev_release,
+  .poll = dev_poll,
+  .mmap = dev_mmap,
+  .unlocked_ioctl = dev_ioctl
+};
+
+
+
+int init_module(void) {
+
+	int i;
+	int ret;
+
+	// Check the size of the buffers requested at load time
+	if(flow_capacity <= 0 || flow_capacity > OBJECT_CAPACITY_LIMIT){
+	  printk("%s: invalid flow_capacity %d\n",MODNAME,flow_capacity);
+	  return -EINVAL;
+	}
+	flow_capacity = roundup_pow_of_two(max_t(int, flow_capacity, PAGE_SIZE));
+
+	//initialize the drive internal state, the buffers are allocated on the first write
+	for(i=0;i<MINORS;i++){
+		mutex_init(&(objects[i].write_synchronizer[0]));
+      mutex_init(&(objects[i].write_synchronizer[1]));
+      mutex_init(&(objects[i].read_synchronizer[0]));
+      mutex_init(&(objects[i].read_synchronizer[1]));
+      init_waitqueue_head(&(objects[i].rd_queue[0]));
+      init_waitqueue_head(&(objects[i].rd_queue[1]));
+      init_waitqueue_head(&(objects[i].wt_queue[0]));
+      init_waitqueue_head(&(objects[i].wt_queue[1]));
+      init_waitqueue_head(&(objects[i].poll_queue[0]));
+      init_waitqueue_head(&(objects[i].poll_queue[1]));
+		objects[i].ring[0] = NULL;
+      objects[i].ring[1] = NULL;
+      atomic_set(&(objects[i].mapped[0]), 0);
+      atomic_set(&(objects[i].mapped[1]), 0);
+      objects[i].capacity[0] = flow_capacity;
+      objects[i].capacity[1] = flow_capacity;
+      objects[i].prio = 0; // Init with high priority
+      objects[i].minor = i;
+      objects[i].debug = 0; // Init with logging disabled
       objects[i].blocking = 1; // Init with non-blocking mode
       objects[i].timeout = 0; // init with no timeout
 		objects[i].stream_content[0] = NULL;
       objects[i].stream_content[1] = NULL;
-		objects[i].stream_content[0] = (char*)__get_free_page(GFP_KERNEL);
-      objects[i].stream_content[1] = (char*)__get_free_page(GFP_KERNEL);
+      objects[i].pending_max = 0;
+      objects[i].pending_bytes_max = 0;
+      atomic_set(&(objects[i].waiting[0]), 0);
+      atomic_set(&(objects[i].waiting[1]), 0);
+      objects[i].shards = NULL; // Init with the high priority flow not sharded
+      objects[i].shard_capacity = 0;
+      objects[i].shard_scan = 0;
+      objects[i].record = 0; // Init as a byte stream
+      objects[i].broadcast = 0; // Init with reads that consume the data
+      objects[i].overwrite = 0; // Init with writers that wait or truncate on a full flow
+      atomic_long_set(&(objects[i].overwritten[0]), 0);
+      atomic_long_set(&(objects[i].overwritten[1]), 0);
+      INIT_LIST_HEAD(&(objects[i].subscribers));
+      spin_lock_init(&(objects[i].broadcast_lock));
+      objects[i].stats = alloc_percpu(flow_stats);
+      objects[i].latency = kzalloc(sizeof(flow_latency),GFP_KERNEL);
+      if (objects[i].stats == NULL || objects[i].latency == NULL || percpu_init_rwsem(&(objects[i].shard_sem)) != 0) {
+        printk("%s: state allocation failed\n",MODNAME);
+        flows_state_free();
+        return -ENOMEM;
+      }
+      atomic_set(&(objects[i].sessions), 0);
+      atomic_set(&(objects[i].writers), 0);
+      atomic_set(&(objects[i].readers), 0);
+      objects[i].spsc = 0; // Init with the locks for every operation
+      atomic_set(&(objects[i].spsc_active[0]), 0);
+      atomic_set(&(objects[i].spsc_active[1]), 0);
+      init_waitqueue_head(&(objects[i].spsc_queue));
+      atomic_set(&(objects[i].pending), 0);
+      objects[i].last_release = jiffies;
+      spin_lock_init(&(objects[i].deferred_lock));
+      INIT_LIST_HEAD(&(objects[i].deferred_list));
+      INIT_DELAYED_WORK(&(objects[i].deferred_work), low_prio_write);
+      objects[i].pending_bytes = 0;
+      init_waitqueue_head(&(objects[i].pending_queue));
 
       // Init of the module parameter arrays
       open_permissions[i] = 0; // Init all open permissions unlocked
       bytes_high[i] = 0;
       bytes_low[i] = 0;
-      atomic_set((atomic_t*)&high_wait_queue_counter[i], 0);
-      atomic_set((atomic_t*)&low_wait_queue_counter[i], 0);
-		if(objects[i].stream_content[0] == NULL || objects[i].stream_content[1] == NULL) goto revert_allocation;
+      pending_low[i] = 0;
+      pending_bytes_low[i] = 0;
+      high_wait_queue_counter[i] = 0;
+      low_wait_queue_counter[i] = 0;
+      overwritten_high[i] = 0;
+      overwritten_low[i] = 0;
+	}
+
+   // Workqueue for the deferred low priority writes
+	deferred_wq = alloc_workqueue("multi-flow-deferred", deferred_wq_unbound ? WQ_UNBOUND : 0, deferred_wq_max_active);
+	if (deferred_wq == NULL) {
+	  printk("%s: workqueue allocation failed\n",MODNAME);
+	  flows_state_free();
+	  return -ENOMEM;
+	}
+
+   // Release the buffers under memory pressure
+	ret = flows_shrinker_register();
+	if (ret < 0) {
+	  printk("%s: registering shrinker failed\n",MODNAME);
+	  destroy_workqueue(deferred_wq);
+	  flows_state_free();
+	  return ret;
 	}
 
    // Register my chardev and check the minor returned
 	Major = __register_chrdev(0, 0, 128, DEVICE_NAME, &fops);
 	if (Major < 0) {
 	  printk("%s: registering device failed\n",MODNAME);
+	  flows_shrinker_unregister();
+	  destroy_workqueue(deferred_wq);
+	  flows_state_free();
 	  return Major;
 	}
 
+	flows_debugfs_create();
+
+	if (idle_reclaim_secs > 0) {
+	  schedule_delayed_work(&reclaim_work, idle_reclaim_secs*HZ);
+	}
+
 	printk(KERN_INFO "%s: new device registered, it is assigned major number %d\n",MODNAME, Major);
    
 	return 0;
-
-   // Deallocate memory in case of mount failure
-revert_allocation:
-	for(;i>=0;i--){
-		free_page((unsigned long)objects[i].stream_content[0]);
-      free_page((unsigned long)objects[i].stream_content[1]);
-	}
-	return -ENOMEM;
 }
 
 void cleanup_module(void) {
 
 	int i;
 
+	debugfs_remove_recursive(flow_debugfs);
+
+   // Stop the release of the buffers before freeing them
+	cancel_delayed_work_sync(&reclaim_work);
+	flows_shrinker_unregister();
+	destroy_workqueue(deferred_wq);
+
    // Deallocation of memory unmounting module
 	for(i=0;i<MINORS;i++){
-		free_page((unsigned long)objects[i].stream_content[0]);
-      free_page((unsigned long)objects[i].stream_content[1]);
+		vfree(objects[i].stream_content[0]);
+      vfree(objects[i].stream_content[1]);
+      vfree(objects[i].ring[0]);
+      vfree(objects[i].ring[1]);
 	}
+	flows_state_free();
 
 	unregister_chrdev(Major, DEVICE_NAME);
 
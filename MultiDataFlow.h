@@ -0,0 +1,57 @@
+/* 
+ * Author : Alessio Malavasi - mat. 0287437 
+ * definitions shared by the Multi-flow device driver and the user programs
+ */
+
+#ifndef _MULTI_DATA_FLOW_H
+#define _MULTI_DATA_FLOW_H
+
+#include <linux/types.h>
+
+/*
+   Control block of a flow, it is the first page of a mapping of the flow
+   and it is followed by the ring buffer of capacity bytes at data_offset.
+   head and tail count the bytes read and written since the flow was created:
+   the valid bytes are tail - head and the byte n is at offset n & (capacity - 1).
+   The reader stores head and the writer stores tail with release semantics,
+   each side loads the other index with acquire semantics.
+*/
+struct multi_flow_ring{
+   __u32 capacity; // size of the ring buffer, a power of two
+   __u32 data_offset; // offset of the ring buffer from the start of the mapping
+   __u32 head __attribute__((aligned(64))); // moved by the reader
+   __u32 tail __attribute__((aligned(64))); // moved by the writer
+};
+
+/*
+   Record mode of a minor: every write is stored as a message made of a __u32 header with
+   the length of the payload, followed by the payload padded to a multiple of the header size.
+   A read returns whole messages in the same layout, so the next header of the buffer
+   is at MULTI_FLOW_RECORD_SIZE(length) bytes from the current one.
+*/
+#define MULTI_FLOW_RECORD_HEADER ((__u32)sizeof(__u32))
+#define MULTI_FLOW_RECORD_SIZE(len) (MULTI_FLOW_RECORD_HEADER + (((len) + MULTI_FLOW_RECORD_HEADER - 1) & ~(MULTI_FLOW_RECORD_HEADER - 1)))
+
+/*
+   Batch of reads or writes on the flows of many minors, done by a single ioctl on any open session.
+   Every entry moves up to len bytes between buf and the flow of the minor of fd, a session of the
+   caller opened for reading or writing as the batch, without sleeping.
+   result is set to the bytes moved or to a negative errno, -EAGAIN when the flow is not ready.
+*/
+struct multi_flow_batch_entry{
+   __s32 fd; // open session of the minor
+   __u32 flow; // 0 : high priority, 1 : low priority
+   __u64 buf; // user address of the data
+   __u32 len;
+   __s32 result; // set by the driver
+};
+
+struct multi_flow_batch{
+   __u64 entries; // user address of count struct multi_flow_batch_entry
+   __u32 count; // at most MULTI_FLOW_BATCH_MAX
+   __u32 write; // 0 : read the flows into the buffers, 1 : write the buffers to the flows
+};
+
+#define MULTI_FLOW_BATCH_MAX 1024
+
+#endif
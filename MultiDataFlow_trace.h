@@ -0,0 +1,160 @@
+/*
+ * Author : Alessio Malavasi - mat. 0287437
+ * Tracepoints of the Multi-flow device file, enabled at run time with
+ * /sys/kernel/tracing/events/multi_flow or attached to with perf and eBPF
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM multi_flow
+
+#if !defined(_MULTI_DATA_FLOW_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MULTI_DATA_FLOW_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+   Data moved on a flow of a minor: the bytes of the operation
+   and the valid bytes of the flow once it is done
+*/
+DECLARE_EVENT_CLASS(multi_flow_io,
+
+   TP_PROTO(int minor, int prio, size_t len, int valid),
+
+   TP_ARGS(minor, prio, len, valid),
+
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(int, prio)
+      __field(size_t, len)
+      __field(int, valid)
+   ),
+
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->prio = prio;
+      __entry->len = len;
+      __entry->valid = valid;
+   ),
+
+   TP_printk("minor=%d prio=%d len=%zu valid=%d",
+      __entry->minor, __entry->prio, __entry->len, __entry->valid)
+);
+
+// High priority write appended to the flow
+DEFINE_EVENT(multi_flow_io, multi_flow_write,
+   TP_PROTO(int minor, int prio, size_t len, int valid),
+   TP_ARGS(minor, prio, len, valid)
+);
+
+// Low priority write queued by put_work, valid are the bytes pending in the deferred queue
+DEFINE_EVENT(multi_flow_io, multi_flow_defer,
+   TP_PROTO(int minor, int prio, size_t len, int valid),
+   TP_ARGS(minor, prio, len, valid)
+);
+
+// Deferred write appended to the flow by low_prio_write
+DEFINE_EVENT(multi_flow_io, multi_flow_deferred_write,
+   TP_PROTO(int minor, int prio, size_t len, int valid),
+   TP_ARGS(minor, prio, len, valid)
+);
+
+// Read done on the flow
+DEFINE_EVENT(multi_flow_io, multi_flow_read,
+   TP_PROTO(int minor, int prio, size_t len, int valid),
+   TP_ARGS(minor, prio, len, valid)
+);
+
+/*
+   Sleep on the read (rd_queue) or write (wt_queue) queue of a flow,
+   len are the bytes waited for and timeout the limit in ns, 0 without limit
+*/
+TRACE_EVENT(multi_flow_wait_enter,
+
+   TP_PROTO(int minor, int prio, int write, size_t len, int valid, u64 timeout),
+
+   TP_ARGS(minor, prio, write, len, valid, timeout),
+
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(int, prio)
+      __field(int, write)
+      __field(size_t, len)
+      __field(int, valid)
+      __field(u64, timeout)
+   ),
+
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->prio = prio;
+      __entry->write = write;
+      __entry->len = len;
+      __entry->valid = valid;
+      __entry->timeout = timeout;
+   ),
+
+   TP_printk("minor=%d prio=%d queue=%s len=%zu valid=%d timeout=%llu",
+      __entry->minor, __entry->prio, __entry->write ? "wt_queue" : "rd_queue",
+      __entry->len, __entry->valid, __entry->timeout)
+);
+
+// Wake up from a read or write queue, timed_out is 1 if the timeout expired before the condition
+TRACE_EVENT(multi_flow_wait_exit,
+
+   TP_PROTO(int minor, int prio, int write, size_t len, int valid, int timed_out),
+
+   TP_ARGS(minor, prio, write, len, valid, timed_out),
+
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(int, prio)
+      __field(int, write)
+      __field(size_t, len)
+      __field(int, valid)
+      __field(int, timed_out)
+   ),
+
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->prio = prio;
+      __entry->write = write;
+      __entry->len = len;
+      __entry->valid = valid;
+      __entry->timed_out = timed_out;
+   ),
+
+   TP_printk("minor=%d prio=%d queue=%s len=%zu valid=%d timed_out=%d",
+      __entry->minor, __entry->prio, __entry->write ? "wt_queue" : "rd_queue",
+      __entry->len, __entry->valid, __entry->timed_out)
+);
+
+// Ioctl on a minor with the value passed by the caller
+TRACE_EVENT(multi_flow_ioctl,
+
+   TP_PROTO(int minor, unsigned int command, int value),
+
+   TP_ARGS(minor, command, value),
+
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(unsigned int, command)
+      __field(int, value)
+   ),
+
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->command = command;
+      __entry->value = value;
+   ),
+
+   TP_printk("minor=%d command=%u value=%d",
+      __entry->minor, __entry->command, __entry->value)
+);
+
+#endif /* _MULTI_DATA_FLOW_TRACE_H */
+
+/* The header is out of include/trace/events, the Makefile adds the module dir to the include path */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE MultiDataFlow_trace
+#include <trace/define_trace.h>
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -7,8 +8,14 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <linux/kdev_t.h>
 
+#include "../MultiDataFlow.h"
+
 
 #define BUFF_SIZE 4096
 
@@ -16,10 +23,28 @@
 Command list : 
 	0 : start n thread for write
 	1 : start n thread for read
-	2 : change priority of the dev
-	3 : change timeout for blocking op of the dev
-	4 : change blocking / non-blocking dev
+	2 : change priority of the sessions opened later on the dev
+	3 : change timeout for blocking op of the sessions opened later on the dev
+	4 : change blocking / non-blocking of the sessions opened later on the dev
 	5 : launch the test routine on the device
+	6 : run the small read/write throughput benchmark
+	7 : resize the buffers of the dev
+	8 : read n minors from one thread with epoll
+	9 : write or read the dev through the mapped flow
+	10 : forward the flow of the dev to a file with splice
+	11 : enable / disable logging of the operations on the dev
+	12 : compare the read/write benchmark with logging disabled and enabled
+	13 : benchmark one writer feeding many blocked readers
+	14 : benchmark one writer and one reader running in parallel
+	15 : compare the parallel benchmark with the spsc mode disabled and enabled
+	16 : compare many writers and one reader with the sharded mode disabled and enabled
+	17 : change the record mode of the dev
+	18 : read the messages of the dev in record mode
+	19 : change the broadcast mode of the dev
+	20 : enable / disable the overwrite mode of the dev
+	21 : read both flows of n minors with a single batch ioctl
+	22 : blocking read that returns once a low watermark of bytes is valid
+	23 : blocking reads with a timeout in microseconds shared by the retries
 */
 
 // Buffer for device name
@@ -52,105 +77,1007 @@ void *only_write(void *data){
 
 	close(fd);
 
-	return NULL;
+	return NULL;
+}
+
+void* only_read(void *data){
+
+	int fd;
+	int ret;
+	int *len = (int*)data;
+
+	// Buffer to recieve the data from kernel
+	char buff[BUFF_SIZE];
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// read from the file
+	printf("start reading of %d bytes from file with fd %d\n",*len,fd);
+	ret = read(fd,buff,*len);
+	if(ret == -1){
+		printf("error reading the file %d\n",fd);
+		return NULL;
+	}
+
+	printf("success reading %d of %d\n",ret,*len);
+	printf("Buffer read content : %s\n\n\n",buff);
+	memset(buff,0,*len);
+
+	close(fd);
+
+	return NULL;
+}
+
+// Settings and operation of a session of the test routine
+struct session_args{
+	int prio;
+	int blocking;
+	int timeout;
+	int len; // bytes to read, if to_write is NULL
+	char *to_write;
+	int lowat; // low watermark of the reads, 0 to wait for the whole read
+};
+
+/*
+	Open a session with its own settings, non-blocking through O_NONBLOCK,
+	and write or read on it, without changing the other sessions of the dev.
+*/
+void* session_op(void *data){
+
+	struct session_args *args = (struct session_args*)data;
+	char buff[BUFF_SIZE];
+	int fd;
+	int ret;
+
+	fd = open(device,O_RDWR | (args->blocking ? O_NONBLOCK : 0));
+	if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// The priority and the timeout are changed only for this session
+	ioctl(fd,0,(unsigned long)&args->prio);
+	ioctl(fd,1,(unsigned long)&args->timeout);
+	if(args->lowat > 0){
+		ioctl(fd,16,(unsigned long)&args->lowat);
+	}
+
+	if(args->to_write != NULL){
+		ret = write(fd,args->to_write,strlen(args->to_write));
+		printf("%s write with priority %d : %d of %ld bytes\n",args->blocking ? "non-blocking" : "blocking",args->prio,ret,strlen(args->to_write));
+	}else{
+		ret = read(fd,buff,args->len);
+		printf("%s read with priority %d : %d of %d bytes",args->blocking ? "non-blocking" : "blocking",args->prio,ret,args->len);
+		if(ret > 0){
+			printf(" : %.*s",ret,buff);
+		}
+		printf("\n");
+	}
+
+	close(fd);
+	return NULL;
+}
+
+void* change_prio(void *data){
+
+	int fd;
+
+	int *prio = (int*)data;
+	printf("Change default priority command with value : %d\n\n\n",*prio);
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to change the priority of the sessions opened from now on
+	ioctl(fd,12,(unsigned long)prio);
+
+	close(fd);
+	return NULL;
+}
+
+void* change_timer(void *data){
+	int *timer = (int*)data;
+	int fd;
+
+	printf("Change default timer command with value : %d\n\n\n",*timer);
+
+	// open the dev
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to change the timer of the sessions opened from now on
+	ioctl(fd,13,(unsigned long)timer);
+
+	close(fd);
+
+	return NULL;
+
+}
+
+void* change_blocking(void* data){
+
+	int *block = (int*)data;
+	int fd;
+
+	printf("Changing default blocking param of device to %d\n\n\n",*block);
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to change the blocking param of the sessions opened from now on
+	ioctl(fd,14,(unsigned long)block);
+
+	close(fd);
+	
+	return NULL;
+}
+
+void* change_capacity(void* data){
+
+	int *capacity = (int*)data;
+	int fd;
+	int ret;
+
+	printf("Resizing buffers of device to %d bytes\n\n\n",*capacity);
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to resize the buffers
+	ret = ioctl(fd,4,(unsigned long)capacity);
+	if(ret == -1){
+		printf("error resizing the buffers : %s\n",strerror(errno));
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+void* change_logging(void* data){
+
+	int *debug = (int*)data;
+	int fd;
+
+	printf("Changing logging of device to %d\n\n\n",*debug);
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to change logging
+	ioctl(fd,6,(unsigned long)debug);
+
+	close(fd);
+
+	return NULL;
+}
+
+void* change_spsc(void* data){
+
+	int *spsc = (int*)data;
+	int fd;
+
+	printf("Changing spsc mode of device to %d\n\n\n",*spsc);
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to change the spsc mode
+	ioctl(fd,7,(unsigned long)spsc);
+
+	close(fd);
+
+	return NULL;
+}
+
+void* change_sharded(void* data){
+
+	int *sharded = (int*)data;
+	int fd;
+	int ret;
+
+	printf("Changing sharded mode of device to %d\n\n\n",*sharded);
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to change the sharded mode
+	ret = ioctl(fd,8,(unsigned long)sharded);
+	if(ret == -1){
+		printf("error changing the sharded mode : %s\n",strerror(errno));
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+void* change_record(void* data){
+
+	int *record = (int*)data;
+	int fd;
+	int ret;
+
+	printf("Changing record mode of device to %d\n\n\n",*record);
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to change the record mode
+	ret = ioctl(fd,9,(unsigned long)record);
+	if(ret == -1){
+		printf("error changing the record mode : %s\n",strerror(errno));
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+void* change_broadcast(void* data){
+
+	int *broadcast = (int*)data;
+	int fd;
+	int ret;
+
+	printf("Changing broadcast mode of device to %d\n\n\n",*broadcast);
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to change the broadcast mode
+	ret = ioctl(fd,10,(unsigned long)broadcast);
+	if(ret == -1){
+		printf("error changing the broadcast mode : %s\n",strerror(errno));
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+void* change_overwrite(void* data){
+
+	int *overwrite = (int*)data;
+	int fd;
+	int ret;
+
+	printf("Changing overwrite mode of device to %d\n\n\n",*overwrite);
+
+	// open the session
+	fd = open(device,O_RDWR);
+     if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	// call the ioctl to change the overwrite mode
+	ret = ioctl(fd,11,(unsigned long)overwrite);
+	if(ret == -1){
+		printf("error changing the overwrite mode : %s\n",strerror(errno));
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+// Elapsed seconds between two timestamps
+double elapsed(struct timespec *start, struct timespec *end){
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+	Throughput benchmark: write a chunk and read it back for the given number of iterations.
+	Run it with the device in non-blocking mode on a build before and after a change to compare them.
+*/
+void bench_rw(int chunk, int iterations){
+
+	int fd;
+	int ret;
+	char buff[BUFF_SIZE];
+	struct timespec start, end;
+	double secs;
+
+	// open the session
+	fd = open(device,O_RDWR);
+	if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return;
+	}
+
+	memset(buff,'a',chunk);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for(int i=0;i<iterations;i++){
+		ret = write(fd,buff,chunk);
+		if(ret != chunk){
+			printf("short write %d of %d at iteration %d\n",ret,chunk,i);
+			break;
+		}
+		ret = read(fd,buff,chunk);
+		if(ret != chunk){
+			printf("short read %d of %d at iteration %d\n",ret,chunk,i);
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	secs = elapsed(&start,&end);
+	printf("%d write+read of %d bytes in %.3f s\n",iterations,chunk,secs);
+	printf("%.0f ops/s, %.0f ns/op, %.2f MB/s\n\n",2*iterations/secs,secs*1e9/(2*iterations),2.0*iterations*chunk/secs/(1024*1024));
+
+	close(fd);
+}
+
+// Parameters of the readers of the blocked readers benchmark
+struct blocked_reader_args{
+	int chunk;
+	int rounds;
+};
+
+// Reader of the blocked readers benchmark, it sleeps on the dev until every chunk arrives
+void* blocked_reader(void *data){
+
+	struct blocked_reader_args *args = (struct blocked_reader_args*)data;
+	char buff[BUFF_SIZE];
+	int fd;
+	int ret;
+
+	fd = open(device,O_RDWR);
+	if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	for(int i=0;i<args->rounds;i++){
+		ret = read(fd,buff,args->chunk);
+		if(ret != args->chunk){
+			printf("short read %d of %d at round %d\n",ret,args->chunk,i);
+			break;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/*
+	Wake up benchmark: n readers sleep on the dev in blocking mode and one writer
+	writes one chunk at a time, so every write can satisfy a single reader.
+	It prints the time and the context switches of the process, on a build that wakes up
+	every sleeping reader at every write they grow with the square of the readers.
+*/
+void bench_blocked_readers(int n_readers, int chunk, int rounds){
+
+	struct blocked_reader_args args = {chunk, rounds};
+	pthread_t readers[n_readers];
+	struct rusage usage_start, usage_end;
+	struct timespec start, end;
+	char buff[BUFF_SIZE];
+	int prio = 0;
+	int block = 0;
+	int no_block = 1;
+	int no_timeout = 0;
+	int fd;
+	int ret;
+	long switches;
+	double secs;
+
+	// High priority blocking dev without timeout
+	change_prio(&prio);
+	change_timer(&no_timeout);
+	change_blocking(&block);
+
+	for(int i=0;i<n_readers;i++){
+		pthread_create(&readers[i],NULL,&blocked_reader,&args);
+	}
+
+	// Let all the readers go to sleep
+	sleep(1);
+
+	fd = open(device,O_RDWR);
+	if(fd == -1) {
+		printf("open error on device %s\n",device);
+		change_blocking(&no_block);
+		return;
+	}
+	memset(buff,'a',chunk);
+
+	getrusage(RUSAGE_SELF,&usage_start);
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for(int i=0;i<n_readers*rounds;i++){
+		ret = write(fd,buff,chunk);
+		if(ret != chunk){
+			printf("short write %d of %d at iteration %d\n",ret,chunk,i);
+			break;
+		}
+	}
+	for(int i=0;i<n_readers;i++){
+		pthread_join(readers[i],NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	getrusage(RUSAGE_SELF,&usage_end);
+
+	close(fd);
+	change_blocking(&no_block);
+
+	secs = elapsed(&start,&end);
+	switches = (usage_end.ru_nvcsw - usage_start.ru_nvcsw) + (usage_end.ru_nivcsw - usage_start.ru_nivcsw);
+	printf("%d readers, %d reads of %d bytes in %.3f s\n",n_readers,n_readers*rounds,chunk,secs);
+	printf("%ld context switches, %.2f per read\n\n",switches,(double)switches/(n_readers*rounds));
+}
+
+// Reader of the parallel benchmark, it reads the chunks written by the other thread
+void* pipe_reader(void *data){
+
+	struct blocked_reader_args *args = (struct blocked_reader_args*)data;
+	char buff[BUFF_SIZE];
+	int fd;
+	int ret;
+
+	// Read only session, so the dev has a single reader
+	fd = open(device,O_RDONLY);
+	if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+
+	for(int i=0;i<args->rounds;i++){
+		ret = read(fd,buff,args->chunk);
+		if(ret != args->chunk){
+			printf("short read %d of %d at iteration %d\n",ret,args->chunk,i);
+			break;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/*
+	Parallel benchmark: one thread writes and another one reads the same flow at the same time,
+	with the dev in blocking mode so every operation moves a whole chunk.
+	On a build where the writer and the reader share the lock of the flow they take turns.
+	The writer and the reader open write only and read only sessions, as the spsc mode needs.
+*/
+void bench_pipe(int chunk, int iterations){
+
+	struct blocked_reader_args args = {chunk, iterations};
+	pthread_t reader;
+	struct timespec start, end;
+	char buff[BUFF_SIZE];
+	int prio = 0;
+	int block = 0;
+	int no_block = 1;
+	int no_timeout = 0;
+	int fd;
+	int ret;
+	double secs;
+
+	// High priority blocking dev without timeout
+	change_prio(&prio);
+	change_timer(&no_timeout);
+	change_blocking(&block);
+
+	fd = open(device,O_WRONLY);
+	if(fd == -1) {
+		printf("open error on device %s\n",device);
+		change_blocking(&no_block);
+		return;
+	}
+	memset(buff,'a',chunk);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	pthread_create(&reader,NULL,&pipe_reader,&args);
+	for(int i=0;i<iterations;i++){
+		ret = write(fd,buff,chunk);
+		if(ret != chunk){
+			printf("short write %d of %d at iteration %d\n",ret,chunk,i);
+			break;
+		}
+	}
+	pthread_join(reader,NULL);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	close(fd);
+	change_blocking(&no_block);
+
+	secs = elapsed(&start,&end);
+	printf("%d writes and %d reads of %d bytes in parallel in %.3f s\n",iterations,iterations,chunk,secs);
+	printf("%.0f ops/s, %.0f ns/op, %.2f MB/s\n\n",2*iterations/secs,secs*1e9/(2*iterations),1.0*iterations*chunk/secs/(1024*1024));
+}
+
+// Writer of the many writers benchmark
+void* bench_writer(void *data){
+
+	struct blocked_reader_args *args = (struct blocked_reader_args*)data;
+	char buff[BUFF_SIZE];
+	int fd;
+	int ret;
+
+	fd = open(device,O_WRONLY);
+	if(fd == -1) {
+		printf("open error on device %s\n",device);
+		return NULL;
+	}
+	memset(buff,'a',args->chunk);
+
+	for(int i=0;i<args->rounds;i++){
+		ret = write(fd,buff,args->chunk);
+		if(ret != args->chunk){
+			printf("short write %d of %d at iteration %d\n",ret,args->chunk,i);
+			break;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/*
+	Many writers benchmark: n threads write on the high priority flow at the same time
+	while one thread reads all the data, with the dev in blocking mode.
+	With the locks the writers take turns on the lock of the flow, in sharded mode
+	every one of them writes to the shard of its cpu.
+*/
+void bench_writers(int n_writers, int chunk, int iterations){
+
+	struct blocked_reader_args writer_args = {chunk, iterations};
+	struct blocked_reader_args reader_args = {chunk, n_writers*iterations};
+	pthread_t writers[n_writers];
+	pthread_t reader;
+	struct timespec start, end;
+	int prio = 0;
+	int block = 0;
+	int no_block = 1;
+	int no_timeout = 0;
+	double secs;
+
+	// High priority blocking dev without timeout
+	change_prio(&prio);
+	change_timer(&no_timeout);
+	change_blocking(&block);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	pthread_create(&reader,NULL,&pipe_reader,&reader_args);
+	for(int i=0;i<n_writers;i++){
+		pthread_create(&writers[i],NULL,&bench_writer,&writer_args);
+	}
+	for(int i=0;i<n_writers;i++){
+		pthread_join(writers[i],NULL);
+	}
+	pthread_join(reader,NULL);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	change_blocking(&no_block);
+
+	secs = elapsed(&start,&end);
+	printf("%d writers, %d writes of %d bytes in %.3f s\n",n_writers,n_writers*iterations,chunk,secs);
+	printf("%.0f writes/s, %.2f MB/s\n\n",n_writers*iterations/secs,1.0*n_writers*iterations*chunk/secs/(1024*1024));
+}
+
+/*
+	Read from n minors starting from the given one with a single thread.
+	The nodes are created as {pathname}{minor}, the data is printed when a minor becomes readable.
+	It stops after 10 seconds without data.
+*/
+void epoll_read(char *path, int major, int first_minor, int n_minors){
+
+	int epfd;
+	int fd;
+	int ret;
+	int ready;
+	char name[256];
+	char buff[BUFF_SIZE];
+	struct epoll_event ev;
+	struct epoll_event events[64];
+
+	epfd = epoll_create1(0);
+	if(epfd == -1){
+		printf("epoll create error\n");
+		return;
+	}
+
+	for(int minor=first_minor;minor<first_minor+n_minors;minor++){
+		// Create the node of the minor if needed
+		snprintf(name,sizeof(name),"%s%d",path,minor);
+		ret = mknod(name,S_IFCHR | 0666,MKDEV(major,minor));
+		if(ret == -1 && errno != EEXIST){
+			printf("Cannot create node %s\n",name);
+			continue;
+		}
+
+		fd = open(name,O_RDONLY | O_NONBLOCK);
+		if(fd == -1){
+			printf("open error on device %s\n",name);
+			continue;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.u64 = ((unsigned long)minor << 32) | fd;
+		if(epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev) == -1){
+			printf("epoll add error on device %s\n",name);
+			close(fd);
+		}
+	}
+
+	printf("waiting data on minors %d - %d\n",first_minor,first_minor+n_minors-1);
+	while((ready = epoll_wait(epfd,events,64,10000)) > 0){
+		for(int i=0;i<ready;i++){
+			fd = (int)(events[i].data.u64 & 0xffffffff);
+			ret = read(fd,buff,BUFF_SIZE-1);
+			if(ret > 0){
+				buff[ret] = '\0';
+				printf("minor %d : read %d bytes : %s\n",(int)(events[i].data.u64 >> 32),ret,buff);
+			}
+		}
+	}
+
+	printf("no data for 10 seconds, stop\n\n");
+	close(epfd);
+}
+
+/*
+	Read both flows of n minors starting from the given one with a single ioctl.
+	The nodes are created as {pathname}{minor} and opened once, then every batch names the sessions by fd.
+	The flows without data report -EAGAIN.
+*/
+void batch_read(char *path, int major, int first_minor, int n_minors){
+
+	int ret;
+	char name[256];
+	int *fds;
+	char (*buffs)[BUFF_SIZE];
+	struct multi_flow_batch batch;
+	struct multi_flow_batch_entry *entries;
+	struct timespec start, end;
+
+	fds = malloc(n_minors*sizeof(int));
+	entries = calloc(2*n_minors,sizeof(struct multi_flow_batch_entry));
+	buffs = malloc(2*n_minors*sizeof(*buffs));
+	if(fds == NULL || entries == NULL || buffs == NULL){
+		printf("Cannot allocate the batch\n");
+		exit(-1);
+	}
+
+	for(int i=0;i<n_minors;i++){
+		// Create the node of the minor if needed
+		snprintf(name,sizeof(name),"%s%d",path,first_minor+i);
+		ret = mknod(name,S_IFCHR | 0666,MKDEV(major,first_minor+i));
+		if(ret == -1 && errno != EEXIST){
+			printf("Cannot create node %s\n",name);
+		}
+
+		// Only the sessions opened for reading can be read by the batch
+		fds[i] = open(name,O_RDONLY);
+		if(fds[i] == -1){
+			printf("open error on device %s\n",name);
+		}
+	}
+
+	for(int i=0;i<2*n_minors;i++){
+		entries[i].fd = fds[i/2];
+		entries[i].flow = i%2;
+		entries[i].buf = (unsigned long)buffs[i];
+		entries[i].len = BUFF_SIZE-1;
+	}
+	batch.entries = (unsigned long)entries;
+	batch.count = 2*n_minors;
+	batch.write = 0;
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	ret = ioctl(fds[0],15,&batch);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	if(ret == -1){
+		printf("batch error : %s\n",strerror(errno));
+	}else{
+		for(int i=0;i<2*n_minors;i++){
+			if(entries[i].result > 0){
+				buffs[i][entries[i].result] = '\0';
+				printf("minor %d flow %u : read %d bytes : %s\n",first_minor+i/2,entries[i].flow,entries[i].result,buffs[i]);
+			}else if(entries[i].result != -EAGAIN){
+				printf("minor %d flow %u : %s\n",first_minor+i/2,entries[i].flow,strerror(-entries[i].result));
+			}
+		}
+		printf("%d of %d flows read in %ld ns\n\n",ret,2*n_minors,(end.tv_sec-start.tv_sec)*1000000000L+(end.tv_nsec-start.tv_nsec));
+	}
+
+	for(int i=0;i<n_minors;i++){
+		if(fds[i] != -1){
+			close(fds[i]);
+		}
+	}
+	free(buffs);
+	free(entries);
+	free(fds);
+}
+
+/*
+	Blocking reads of len bytes on a new session with a budget of timeout_us microseconds for all of them:
+	after every read the time left is taken from the session and becomes the timeout of the next one.
+*/
+void timed_read(int len, long long timeout_us){
+
+	int fd;
+	int ret;
+	char buff[BUFF_SIZE];
+	unsigned long long timeout = timeout_us * 1000;
+	int block = 0;
+
+	fd = open(device,O_RDONLY);
+	if(fd == -1){
+		printf("open error on device %s\n",device);
+		return;
+	}
+	ioctl(fd,3,(unsigned long)&block);
+
+	while(timeout > 0){
+		ioctl(fd,17,(unsigned long)&timeout);
+		ret = read(fd,buff,len);
+		ioctl(fd,18,(unsigned long)&timeout);
+		if(ret == -1){
+			printf("read error : %s, %llu us left\n",strerror(errno),timeout/1000);
+			break;
+		}
+		printf("read %d of %d bytes : %.*s, %llu us left\n",ret,len,ret,buff,timeout/1000);
+	}
+
+	printf("timeout expired\n\n");
+	close(fd);
+}
+
+/*
+	Map the flow of the current priority of the session: first only the control block
+	to learn the capacity, then the control block and the ring buffer.
+*/
+struct multi_flow_ring* map_flow(int fd, size_t *size){
+
+	long page = sysconf(_SC_PAGESIZE);
+	struct multi_flow_ring *ring;
+	unsigned int capacity;
+
+	ring = mmap(NULL,page,PROT_READ,MAP_SHARED,fd,0);
+	if(ring == MAP_FAILED){
+		return NULL;
+	}
+	capacity = ring->capacity;
+	munmap(ring,page);
+
+	*size = page + capacity;
+	ring = mmap(NULL,*size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	if(ring == MAP_FAILED){
+		return NULL;
+	}
+
+	return ring;
 }
 
-void* only_read(void *data){
+// Write the string in the mapped ring buffer and ring the doorbell for the readers
+void mmap_write(char *to_write){
 
 	int fd;
-	int ret;
-	int *len = (int*)data;
+	size_t size;
+	struct multi_flow_ring *ring;
+	char *data;
+	unsigned int head, tail, len, free_bytes;
 
-	// Buffer to recieve the data from kernel
-	char buff[BUFF_SIZE];
-
-	// open the session
 	fd = open(device,O_RDWR);
-     if(fd == -1) {
+	if(fd == -1) {
 		printf("open error on device %s\n",device);
-		return NULL;
+		return;
 	}
 
-	// read from the file
-	printf("start reading of %d bytes from file with fd %d\n",*len,fd);
-	ret = read(fd,buff,*len);
-	if(ret == -1){
-		printf("error reading the file %d\n",fd);
-		return NULL;
+	ring = map_flow(fd,&size);
+	if(ring == NULL){
+		printf("mmap error on device %s : %s\n",device,strerror(errno));
+		close(fd);
+		return;
 	}
+	data = (char*)ring + ring->data_offset;
 
-	printf("success reading %d of %d\n",ret,*len);
-	printf("Buffer read content : %s\n\n\n",buff);
-	memset(buff,0,*len);
+	// Space freed by the readers
+	head = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+	tail = ring->tail;
+	free_bytes = ring->capacity - (tail - head);
 
-	close(fd);
+	len = strlen(to_write);
+	if(len > free_bytes){
+		len = free_bytes;
+	}
 
-	return NULL;
+	for(unsigned int i=0;i<len;i++){
+		data[(tail + i) & (ring->capacity - 1)] = to_write[i];
+	}
+
+	// Publish the data, then wake up the readers
+	__atomic_store_n(&ring->tail,tail + len,__ATOMIC_RELEASE);
+	ioctl(fd,5,0);
+
+	printf("data written through the mapping %u of %ld\n\n\n",len,strlen(to_write));
+
+	munmap(ring,size);
+	close(fd);
 }
 
-void* change_prio(void *data){
+// Read all the valid bytes from the mapped ring buffer and ring the doorbell for the writers
+void mmap_read(){
 
 	int fd;
+	size_t size;
+	struct multi_flow_ring *ring;
+	char *data;
+	char buff[BUFF_SIZE];
+	unsigned int head, tail, len;
 
-	int *prio = (int*)data;
-	printf("Change priority command with value : %d\n\n\n",*prio);
-
-	// open the session
 	fd = open(device,O_RDWR);
-     if(fd == -1) {
+	if(fd == -1) {
 		printf("open error on device %s\n",device);
-		return NULL;
+		return;
+	}
+
+	ring = map_flow(fd,&size);
+	if(ring == NULL){
+		printf("mmap error on device %s : %s\n",device,strerror(errno));
+		close(fd);
+		return;
+	}
+	data = (char*)ring + ring->data_offset;
+
+	// Data published by the writers
+	tail = __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE);
+	head = ring->head;
+
+	len = tail - head;
+	if(len > BUFF_SIZE - 1){
+		len = BUFF_SIZE - 1;
+	}
+
+	for(unsigned int i=0;i<len;i++){
+		buff[i] = data[(head + i) & (ring->capacity - 1)];
 	}
+	buff[len] = '\0';
+
+	// Give the space back, then wake up the writers
+	__atomic_store_n(&ring->head,head + len,__ATOMIC_RELEASE);
+	ioctl(fd,5,0);
 
-	// call the ioctl to change priority
-	ioctl(fd,0,(unsigned long)prio);
+	printf("success reading %u bytes through the mapping\n",len);
+	printf("Buffer read content : %s\n\n\n",buff);
 
+	munmap(ring,size);
 	close(fd);
-	return NULL;
 }
 
-void* change_timer(void *data){
-	int *timer = (int*)data;
-	int fd;
+/*
+	Read up to len bytes of messages from a dev in record mode with a single read,
+	then walk the headers to print every message.
+*/
+void record_read(int len){
 
-	printf("Change timer command with value : %d\n\n\n",*timer);
+	int fd;
+	int ret;
+	char buff[BUFF_SIZE];
+	__u32 msg_len;
+	int n = 0;
 
-	// open the dev
 	fd = open(device,O_RDWR);
-     if(fd == -1) {
+	if(fd == -1) {
 		printf("open error on device %s\n",device);
-		return NULL;
+		return;
 	}
 
-	// call the ioctl to change timer
-	ioctl(fd,1,(unsigned long)timer);
-
-	close(fd);
+	ret = read(fd,buff,len);
+	if(ret == -1){
+		printf("error reading the messages : %s\n",strerror(errno));
+		close(fd);
+		return;
+	}
 
-	return NULL;
+	// The last message can be truncated and miss its padding
+	for(int offset=0;offset + (int)MULTI_FLOW_RECORD_HEADER <= ret;offset += MULTI_FLOW_RECORD_SIZE(msg_len)){
+		memcpy(&msg_len,buff + offset,MULTI_FLOW_RECORD_HEADER);
+		printf("message %d of %u bytes : %.*s\n",n,msg_len,(int)msg_len,buff + offset + MULTI_FLOW_RECORD_HEADER);
+		n++;
+	}
+	printf("success reading %d messages in %d bytes\n\n\n",n,ret);
 
+	close(fd);
 }
 
-void* change_blocking(void* data){
+/*
+	Move up to len bytes from the dev to the file through a pipe with splice,
+	the data never goes through a user buffer.
+*/
+void splice_to_file(char *pathname, int len){
 
-	int *block = (int*)data;
 	int fd;
+	int out;
+	int pipefd[2];
+	ssize_t in_pipe;
+	ssize_t written;
 
-	printf("Changing blocking param of device to %d\n\n\n",*block);
-
-	// open the session
 	fd = open(device,O_RDWR);
-     if(fd == -1) {
+	if(fd == -1) {
 		printf("open error on device %s\n",device);
-		return NULL;
+		return;
+	}
+
+	out = open(pathname,O_WRONLY | O_CREAT | O_APPEND,0644);
+	if(out == -1) {
+		printf("open error on file %s\n",pathname);
+		close(fd);
+		return;
 	}
 
-	// call the ioctl to change blocking param
-	ioctl(fd,3,(unsigned long)block);
+	if(pipe(pipefd) == -1){
+		printf("pipe error\n");
+		close(out);
+		close(fd);
+		return;
+	}
+
+	// From the flow to the pipe, then from the pipe to the file
+	in_pipe = splice(fd,NULL,pipefd[1],NULL,len,0);
+	if(in_pipe == -1){
+		printf("splice error from device %s : %s\n",device,strerror(errno));
+	}else{
+		written = 0;
+		while(written < in_pipe){
+			ssize_t ret = splice(pipefd[0],NULL,out,NULL,in_pipe - written,0);
+			if(ret <= 0){
+				printf("splice error to file %s : %s\n",pathname,strerror(errno));
+				break;
+			}
+			written += ret;
+		}
+		printf("forwarded %ld bytes of %d to %s\n\n\n",written,len,pathname);
+	}
 
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(out);
 	close(fd);
-	
-	return NULL;
 }
 
 
@@ -307,67 +1234,467 @@ int main(int argc, char** argv){
      		break;
      	case 5:
      		printf("\n--- Init test routine ---\n");
-     		char *test_write = "testwrite\n";
-     		int test_read = strlen(test_write)-1;
-     		int test_block = 0;
-     		int test_prio = 1;
-     		int test_timeout = 8;
-
-     		// Spawn a non blocking read thread
-     		pthread_create(&tid,NULL,&only_read,&test_read);
+     		char *test_write = "testwrite";
+     		int test_read = strlen(test_write);
+     		// Every session has its own priority, blocking mode and timeout, the dev is never changed
+     		struct session_args high_nonblock_read = {0, 1, 0, test_read, NULL};
+     		struct session_args high_block_read = {0, 0, 8, test_read, NULL};
+     		struct session_args high_write = {0, 1, 0, 0, test_write};
+     		struct session_args low_write = {1, 1, 0, 0, test_write};
+     		struct session_args low_nonblock_read = {1, 1, 0, test_read, NULL};
+
+     		// Spawn a non blocking read thread, and a low priority write at the same time
+     		pthread_create(&tid,NULL,&session_op,&high_nonblock_read);
+     		pthread_create(&tid,NULL,&session_op,&low_write);
 
      		sleep(2);
 
      		// Spawn 2 write threads
      		for(int i=0;i<2;i++){
-     			pthread_create(&tid,NULL,&only_write,(void*)test_write);
+     			pthread_create(&tid,NULL,&session_op,&high_write);
      		}
 
      		sleep(2);
 
-     		// set the device in blocking mode
-     		pthread_create(&tid,NULL,&change_blocking,&test_block);
-
-     		sleep(2);
-
-     		// Spawn 3 blocking read threads.
-     		// 2 success - 1 blocked
+     		// Spawn 3 blocking read threads with a timeout of 8 seconds, and two non-blocking low priority reads.
+     		// 2 success - 1 blocked, 1 low priority success - 1 empty
      		for(int i=0;i<3;i++){
-     			pthread_create(&tid,NULL,&only_read,&test_read);
+     			pthread_create(&tid,NULL,&session_op,&high_block_read);
+     		}
+     		for(int i=0;i<2;i++){
+     			pthread_create(&tid,NULL,&session_op,&low_nonblock_read);
      		}
 
-     		// Wait 8 seconds
-     		sleep(8);
+     		sleep(2);
 
      		// Launch one write thread. The blocked read one will wake up and read the data.
-     		pthread_create(&tid,NULL,&only_write,(void*)test_write);
+     		pthread_create(&tid,NULL,&session_op,&high_write);
 
      		sleep(2);
+     		printf("\n--- Test routine completed ---\n");
+     		break;
+     	case 6:
+     		printf("--- Starting read/write benchmark ---\n");
+     		int chunk;
+     		int iterations;
+
+     		// Size of every write and read
+     		printf("Insert bytes for every read and write (1 - %d) : ",BUFF_SIZE);
+     		ret = scanf("%d",&chunk);
+     		if(ret == 0 || chunk <= 0 || chunk > BUFF_SIZE){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
 
-     		// reset the device in non-blocking mode
-     		test_block = 1;
-     		pthread_create(&tid,NULL,&change_blocking,&test_block);
+     		// How many iterations
+     		printf("Insert how many iterations : ");
+     		ret = scanf("%d",&iterations);
+     		if(ret == 0 || iterations <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
 
-     		sleep(2);
+     		bench_rw(chunk,iterations);
+     		break;
+     	case 7:
+     		printf("--- Starting ioctl resize buffers ---\n");
+     		int capacity;
+
+     		// Chose the new size
+     		printf("Insert the new size of the buffers in bytes\n");
+     		ret = scanf("%d",&capacity);
+     		if(ret == 0 || capacity <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
 
-     		// Set priority to low
-     		pthread_create(&tid,NULL,&change_prio,&test_prio);
+     		pthread_create(&tid,NULL,&change_capacity,&capacity);
+     		break;
+     	case 8:
+     		printf("--- Starting epoll read ---\n");
+     		int n_minors;
+
+     		// How many minors to read
+     		printf("Insert how many minors to read starting from %d : ",minor);
+     		ret = scanf("%d",&n_minors);
+     		if(ret == 0 || n_minors <= 0 || minor + n_minors > 128){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
 
-     		sleep(2);
+     		epoll_read(path,major,minor,n_minors);
+     		break;
+     	case 9:
+     		printf("--- Starting mapped flow access ---\n");
+     		int map_op;
+     		char map_write[128];
+
+     		// Chose the operation
+     		printf("Insert operation on the mapped flow\n");
+     		printf("0 : write\n1 : read\n");
+     		ret = scanf("%d",&map_op);
+     		if(ret == 0 || (map_op != 0 && map_op != 1)){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
 
-     		// Launch one write on low priority
-     		pthread_create(&tid,NULL,&only_write,(void*)test_write);
+     		if(map_op == 0){
+     			// String to write
+     			printf("Insert string to write : ");
+     			if(fgets(map_write,128,stdin) == NULL){
+     				printf("Error reading the string\n");
+     				exit(-1);
+     			}
+     			// delete last char \n
+     			map_write[strcspn(map_write,"\n")] = '\0';
+     			mmap_write(map_write);
+     		}else{
+     			mmap_read();
+     		}
+     		break;
+     	case 10:
+     		printf("--- Starting splice to file ---\n");
+     		char out_path[128];
+     		int to_splice;
+
+     		// Destination file
+     		printf("Insert the file to append the data to : ");
+     		if(fgets(out_path,128,stdin) == NULL){
+     			printf("Error reading the string\n");
+     			exit(-1);
+     		}
+     		out_path[strcspn(out_path,"\n")] = '\0';
 
-     		sleep(2);
+     		// How many bytes to forward
+     		printf("Insert how many bytes to forward : ");
+     		ret = scanf("%d",&to_splice);
+     		if(ret == 0 || to_splice <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
 
-     		// Spawn two read threads non-blocking on low priority
-     		// Could run before or after the write thread!!
-     		for(int i=0;i<2;i++){
-     			pthread_create(&tid,NULL,&only_read,&test_read);
+     		splice_to_file(out_path,to_splice);
+     		break;
+     	case 11:
+     		printf("--- Starting ioctl change logging ---\n");
+     		int debug;
+
+     		// Chose logging value
+     		printf("Insert value to set logging of the operations\n");
+     		printf("0 : disabled\n1 : enabled\n");
+     		ret = scanf("%d",&debug);
+     		if(ret == 0 || (debug != 0 && debug != 1)){
+     			printf("Invalid number\n");
+     			exit(-1);
      		}
+     		getchar();
 
-     		sleep(2);
-     		printf("\n--- Test routine completed ---\n");
+     		pthread_create(&tid,NULL,&change_logging,&debug);
+     		break;
+     	case 12:
+     		printf("--- Starting logging benchmark ---\n");
+     		int log_chunk;
+     		int log_iterations;
+     		int log_off = 0;
+     		int log_on = 1;
+
+     		printf("Insert bytes for every read and write (1 - %d) : ",BUFF_SIZE);
+     		ret = scanf("%d",&log_chunk);
+     		if(ret == 0 || log_chunk <= 0 || log_chunk > BUFF_SIZE){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert how many iterations : ");
+     		ret = scanf("%d",&log_iterations);
+     		if(ret == 0 || log_iterations <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		// Same benchmark with logging disabled, then enabled, then restore disabled
+     		change_logging(&log_off);
+     		printf("logging disabled:\n");
+     		bench_rw(log_chunk,log_iterations);
+
+     		change_logging(&log_on);
+     		printf("logging enabled:\n");
+     		bench_rw(log_chunk,log_iterations);
+
+     		change_logging(&log_off);
+     		break;
+     	case 13:
+     		printf("--- Starting blocked readers benchmark ---\n");
+     		int n_readers;
+     		int wake_chunk;
+     		int rounds;
+
+     		printf("Insert how many readers : ");
+     		ret = scanf("%d",&n_readers);
+     		if(ret == 0 || n_readers <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert bytes for every read and write (1 - %d) : ",BUFF_SIZE);
+     		ret = scanf("%d",&wake_chunk);
+     		if(ret == 0 || wake_chunk <= 0 || wake_chunk > BUFF_SIZE){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert how many reads for every reader : ");
+     		ret = scanf("%d",&rounds);
+     		if(ret == 0 || rounds <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		bench_blocked_readers(n_readers,wake_chunk,rounds);
+     		break;
+     	case 14:
+     		printf("--- Starting parallel write/read benchmark ---\n");
+     		int pipe_chunk;
+     		int pipe_iterations;
+
+     		printf("Insert bytes for every read and write (1 - %d) : ",BUFF_SIZE);
+     		ret = scanf("%d",&pipe_chunk);
+     		if(ret == 0 || pipe_chunk <= 0 || pipe_chunk > BUFF_SIZE){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert how many iterations : ");
+     		ret = scanf("%d",&pipe_iterations);
+     		if(ret == 0 || pipe_iterations <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		bench_pipe(pipe_chunk,pipe_iterations);
+     		break;
+     	case 15:
+     		printf("--- Starting spsc benchmark ---\n");
+     		int spsc_chunk;
+     		int spsc_iterations;
+     		int spsc_off = 0;
+     		int spsc_on = 1;
+
+     		printf("Insert bytes for every read and write (1 - %d) : ",BUFF_SIZE);
+     		ret = scanf("%d",&spsc_chunk);
+     		if(ret == 0 || spsc_chunk <= 0 || spsc_chunk > BUFF_SIZE){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert how many iterations : ");
+     		ret = scanf("%d",&spsc_iterations);
+     		if(ret == 0 || spsc_iterations <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		// Same benchmark with the locks, then with the spsc mode, then restore the locks
+     		change_spsc(&spsc_off);
+     		printf("spsc mode disabled:\n");
+     		bench_pipe(spsc_chunk,spsc_iterations);
+
+     		change_spsc(&spsc_on);
+     		printf("spsc mode enabled:\n");
+     		bench_pipe(spsc_chunk,spsc_iterations);
+
+     		change_spsc(&spsc_off);
+     		break;
+     	case 16:
+     		printf("--- Starting sharded benchmark ---\n");
+     		int n_writers;
+     		int shard_chunk;
+     		int shard_iterations;
+     		int sharded_off = 0;
+     		int sharded_on = 1;
+
+     		printf("Insert how many writers : ");
+     		ret = scanf("%d",&n_writers);
+     		if(ret == 0 || n_writers <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert bytes for every read and write (1 - %d) : ",BUFF_SIZE);
+     		ret = scanf("%d",&shard_chunk);
+     		if(ret == 0 || shard_chunk <= 0 || shard_chunk > BUFF_SIZE){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert how many writes for every writer : ");
+     		ret = scanf("%d",&shard_iterations);
+     		if(ret == 0 || shard_iterations <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		// Same benchmark with the locks, then in sharded mode, then restore the locks
+     		change_sharded(&sharded_off);
+     		printf("sharded mode disabled:\n");
+     		bench_writers(n_writers,shard_chunk,shard_iterations);
+
+     		change_sharded(&sharded_on);
+     		printf("sharded mode enabled:\n");
+     		bench_writers(n_writers,shard_chunk,shard_iterations);
+
+     		change_sharded(&sharded_off);
+     		break;
+     	case 17:
+     		printf("--- Starting ioctl change record mode ---\n");
+     		int record;
+
+     		// Chose record value
+     		printf("Insert value to set the record mode\n");
+     		printf("0 : byte stream\n1 : messages truncated when they do not fit\n2 : messages rejected when they do not fit\n");
+     		ret = scanf("%d",&record);
+     		if(ret == 0 || record < 0 || record > 2){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		pthread_create(&tid,NULL,&change_record,&record);
+     		break;
+     	case 18:
+     		printf("--- Starting read of messages ---\n");
+     		int record_len;
+
+     		// Size of the buffer of the read
+     		printf("Insert the size of the buffer for the messages (1 - %d) : ",BUFF_SIZE);
+     		ret = scanf("%d",&record_len);
+     		if(ret == 0 || record_len <= 0 || record_len > BUFF_SIZE){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		record_read(record_len);
+     		break;
+     	case 19:
+     		printf("--- Starting ioctl change broadcast mode ---\n");
+     		int broadcast;
+
+     		// Chose broadcast value
+     		printf("Insert value to set the broadcast mode\n");
+     		printf("0 : disabled\nn : enabled, readers lagging more than n bytes are dropped\n");
+     		ret = scanf("%d",&broadcast);
+     		if(ret == 0 || broadcast < 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		pthread_create(&tid,NULL,&change_broadcast,&broadcast);
+     		break;
+     	case 20:
+     		printf("--- Starting ioctl change overwrite mode ---\n");
+     		int overwrite;
+
+     		// Chose overwrite value
+     		printf("Insert value to set the overwrite mode\n");
+     		printf("0 : disabled\n1 : enabled\n");
+     		ret = scanf("%d",&overwrite);
+     		if(ret == 0 || (overwrite != 0 && overwrite != 1)){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		pthread_create(&tid,NULL,&change_overwrite,&overwrite);
+     		break;
+     	case 21:
+     		printf("--- Starting batch read ---\n");
+     		int batch_minors;
+
+     		// How many minors to read
+     		printf("Insert how many minors to read starting from %d : ",minor);
+     		ret = scanf("%d",&batch_minors);
+     		if(ret == 0 || batch_minors <= 0 || minor + batch_minors > 128){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		batch_read(path,major,minor,batch_minors);
+     		break;
+     	case 22:
+     		printf("--- Starting low watermark read ---\n");
+     		struct session_args lowat_read = {0, 0, 0, 0, NULL, 0};
+
+     		// Chose priority and sizes
+     		printf("Insert priority of the read\n");
+     		printf("0 : high priority\n1 : low priority\n");
+     		ret = scanf("%d",&lowat_read.prio);
+     		if(ret == 0 || (lowat_read.prio != 0 && lowat_read.prio != 1)){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert bytes to read (1 - %d) : ",BUFF_SIZE);
+     		ret = scanf("%d",&lowat_read.len);
+     		if(ret == 0 || lowat_read.len <= 0 || lowat_read.len > BUFF_SIZE){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert the low watermark, the read returns once as many bytes are valid : ");
+     		ret = scanf("%d",&lowat_read.lowat);
+     		if(ret == 0 || lowat_read.lowat <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		pthread_create(&tid,NULL,&session_op,&lowat_read);
+     		break;
+     	case 23:
+     		printf("--- Starting timed reads ---\n");
+     		int timed_len;
+     		long long timed_us;
+
+     		printf("Insert bytes for every read (1 - %d) : ",BUFF_SIZE);
+     		ret = scanf("%d",&timed_len);
+     		if(ret == 0 || timed_len <= 0 || timed_len > BUFF_SIZE){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		printf("Insert the timeout of all the reads in microseconds : ");
+     		ret = scanf("%lld",&timed_us);
+     		if(ret == 0 || timed_us <= 0){
+     			printf("Invalid number\n");
+     			exit(-1);
+     		}
+     		getchar();
+
+     		timed_read(timed_len,timed_us);
      		break;
      	default:
      		printf("Invalid command : %d\n",command);